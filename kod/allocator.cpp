@@ -1,363 +1,969 @@
-#include "allocator.h"
-#include <string>
-#include <cmath>
-#include <cstdio>
-#include <cstring>
-
-
-void* Allocator::space = nullptr;
-int Allocator::block_num = 0;
-bool Allocator::is_initialized = false;
-int Allocator::buddy[] = { 0 };
-Cache* Allocator::cache_for_handles = nullptr;
-Cache* Allocator::cache_for_caches = nullptr;
-Cache* Allocator::sizes[] = { nullptr };
-std::recursive_mutex Allocator::m;
-
-
-void Allocator::init(void *space, int block_num) {
-	if (Allocator::is_initialized) {
-		std::cout << "Allocator has already been initialized!" << std::endl;
-		return;
-	}
-	if (block_num < 0 || block_num >= (1 << N)) {
-		std::cout << "NUMBER OF BLOCKS (" + std::to_string(block_num) + ") EXCEEDING MAXIMUM (2^" + std::to_string(N) + " - 1)" << std::endl;
-		exit(4);
-	}
-
-	Allocator::space = space;
-	Allocator::block_num = block_num;
-
-	int i = N - 1;
-	int mask = 1 << (N - 1);
-	int blocks_offset = 0;
-	while (i >= 0) {
-		int blocks_i = block_num & mask;
-		if (blocks_i) {
-			buddy[i] = blocks_offset;
-			*((int*)block(blocks_offset)) = -1;
-			blocks_offset += blocks_i;
-		}
-		else buddy[i] = -1;
-		--i;
-		mask >>= 1;
-	}
-
-	cache_for_caches = Cache::createCacheForCaches();
-	if (!cache_for_caches) exit(1);	// Fatal error.
-	cache_for_handles = Cache::createCache("CACHE FOR HANDLES", sizeof(kmem_cache_t), nullptr, nullptr);
-	if (!cache_for_handles) exit(2);	// Fatal error.
-
-	// SIZE CACHES ARE CREATED IMPLICITLY WHEN THERE IS NEED TO ALLOCATE A CERTAIN SIZE BUFFER FOR THE FIRST TIME
-
-	Allocator::is_initialized = true;
-}
-
-
-void* Allocator::block(int n) {
-	if (n < 0 || n >= block_num) return nullptr;	// will return nullptr even if allocator is uninitialized because then block_num is 0
-	return (void*)((char*)space + n*BLOCK_SIZE);
-}
-
-
-int Allocator::find_buddy(int n, int i) {
-	if (n < 0 || n >= block_num || i < 0 || i >= N) return -1;	// Error: n or i out of range.
-	int size_in_blocks = 1;
-	for (int j = 0; j < i; j++) size_in_blocks *= 2;
-	if (n % size_in_blocks != 0) return -1;	// Error: misaligned n.
-	int chunk_position = n / size_in_blocks;
-	// The code below checks if the block has no buddy (due to block_num not being a power of 2).
-	// A different "error" value is returned (-2, not -1) in case there is no buddy.
-	if (chunk_position % 2 == 0) return (n + size_in_blocks * 2 > block_num) ? -2 : n + size_in_blocks;
-	else return n + size_in_blocks > block_num ? -2 : n - size_in_blocks;
-}
-
-
-void* Allocator::buddy_alloc(int i) {
-	m.lock();
-	if (i < 0 || i >= N) {	// error
-		m.unlock();
-		return nullptr;
-	}
-	// First, try to find the segment of exact size of 2^i blocks:
-	if (buddy[i] > -1) {
-		// Found! Remove it from the list buddy[i] and return it:
-		void* ret = block(buddy[i]);
-		buddy[i] = *((int*)ret);
-		m.unlock();
-		return ret;
-	}
-	// Else, find the first next bigger segment:
-	for (int j = i + 1; j < N; j++) {
-		int seg1 = buddy[j];
-		if (seg1 > -1) {
-			// Found. Divide it into two halves:
-			int seg2 = seg1 + (1 << (j-1));
-			int* pSeg1 = (int*)block(seg1);
-			int* pSeg2 = (int*)block(seg2);
-			// Remove it from buddy[j]:
-			buddy[j] = *pSeg1;
-			// Add two segments to buddy[j-1]:
-			*pSeg2 = buddy[j - 1];
-			*pSeg1 = seg2;
-			buddy[j - 1] = seg1;
-			// Now, try again from the beginning (recursion).
-			// You will find it eventually!
-			void* ret = buddy_alloc(i);
-			m.unlock();
-			return ret;
-		}
-	}
-	m.unlock();
-	// Not found, no memory:
-	return nullptr;
-}
-
-
-void* Allocator::buddy_alloc_blocks_required(int blocks) {
-	if (blocks <= 0) return nullptr;	// Error. However, if number of blocks is too large,
-										// the error will be addressed in buddy_alloc(i).
-	int i = 0;
-	for (int n = 1; n < blocks; n *= 2) i++;
-	return buddy_alloc(i);
-}
-
-
-void* Allocator::buddy_alloc_space_required(int bytes) {
-	if (bytes <= 0) return nullptr;	// error
-	int blocks = bytes / BLOCK_SIZE;
-	if (bytes % BLOCK_SIZE > 0) ++blocks;
-	return buddy_alloc_blocks_required(blocks);
-}
-
-
-int Allocator::bytes_required_to_blocks_allocated(int bytes) {
-	if (bytes <= 0) return -1;	// error
-	int blocks = bytes / BLOCK_SIZE;
-	if (bytes % BLOCK_SIZE > 0) ++blocks;
-	int n = 1;
-	while (n < blocks) n *= 2;
-	return n;
-}
-
-
-int Allocator::buddy_free(int n, int i) {
-	m.lock();
-	if (i < 0 || i >= N) {	// Error: i out of range.
-		m.unlock();
-		return -1;
-	}
-	int* pn = (int*)block(n);
-	if (pn == nullptr) {	// Error: illegal block n.
-		m.unlock();
-		return -1;
-	}
-	int nb = find_buddy(n, i);	// Find the buddy of n.
-	if (nb == -1) {	// Error: mismatching n and i.
-		m.unlock();
-		return -1;
-	}
-
-	// First, try to find the buddy of block n in the list buddy[i]:
-	int prev = -1, cur = buddy[i];
-	while (cur != -1 && cur != nb) {
-		prev = cur;
-		int* pc = (int*)block(cur);
-		if (pc == nullptr) {	// Unexpected error: corrupted structure.
-			m.unlock();
-			return -1;
-		}
-		cur = *pc;
-	}
-
-	if (cur == -1) {	// Not found; just add block n to the list buddy[i].
-		*pn = buddy[i];
-		buddy[i] = n;
-		m.unlock();
-		return 0;
-	}
-
-	// Found the buddy. Remove it from buddy[i]:
-	int* pc = (int*)block(cur);
-	if (pc == 0) {	// Unexpected error: corrupted structure.
-		m.unlock();
-		return -1;
-	}
-	if (prev != -1) {
-		int* pp = (int*)block(prev);
-		if (pp == nullptr) {	// Unexpected error: corrupted structure.
-			m.unlock();
-			return -1;
-		}
-		*pp = *pc;
-	}
-	else
-		buddy[i] = *pc;
-	*pc = -1;
-
-	// Then join n and its buddy nb to one block nm and add it to buddy[i+1]:
-	int nm = n < nb ? n : nb;	// nm = min(n, nb)
-	if (i < N - 1) {	// Recursion.
-		int ret = buddy_free(nm, i + 1);
-		m.unlock();
-		return ret;
-	}
-	else {
-		m.unlock();
-		return -1;	// Unexpected error: should never occur.
-	}
-}
-
-
-int Allocator::deallocate(void* space_to_free, int num_of_blocks) {
-	int first_block = ((char*)space_to_free - (char*)space) / BLOCK_SIZE;
-	int i = 0;
-	for (int blocks = 1; blocks < num_of_blocks; blocks *= 2, i++);
-	return buddy_free(first_block, i);
-}
-
-
-void* Allocator::allocateMemoryForCacheCreation() {
-	return cache_for_caches != nullptr ? cache_for_caches->alloc() : nullptr;
-}
-
-
-kmem_cache_t* Allocator::cache_create(const char *name, size_t size, void(*ctor)(void *), void(*dtor)(void *)) {
-	Cache* c = Cache::createCache(name, size, ctor, dtor);
-	kmem_cache_t* ret = (kmem_cache_t*)cache_for_handles->alloc();
-	ret->c = c;
-	return ret;
-}
-
-
-void* Allocator::malloc(size_t size) {
-	size_t lower_limit = 0;
-	size_t upper_limit = MIN_SIZE_POWER_OF_2_BYTES;
-	for (int i = 0; i < SIZES; i++) {
-		if (size > lower_limit && size <= upper_limit) {
-			if (!sizes[i]) {
-				// Create size-N cache if one does not exist.
-				std::string s = "size-";
-				s += std::to_string(upper_limit);
-				sizes[i] = Cache::createCache(s.c_str(), upper_limit, nullptr, nullptr);
-				if (!sizes[i]) return nullptr;	// error
-			}
-			return sizes[i]->alloc();
-		}
-		lower_limit = upper_limit;
-		upper_limit *= 2;
-	}
-	return nullptr;
-}
-
-
-void Allocator::free(const void* objp) {
-	for (int i = 0; i < SIZES; i++) {
-		if (sizes[i] != nullptr && sizes[i]->free((void*)objp) == true) {
-			sizes[i]->shrink();	// It is neccessary to shrink sizes here because it cannot be done from outside.
-								// Also - FORCE SHRINK? (Create special shrink method that cannot be avoided - see Cache::shrink()).
-			return;
-		}
-	}
-}
-
-
-void Allocator::cache_destroy(kmem_cache_t* cachep) {
-	cachep->destroy();
-	cache_for_caches->free(cachep->c);
-	cache_for_handles->free(cachep);
-	cachep->c = nullptr;
-}
-
-
-void Allocator::sizes_info(int index) {
-	if (index < 0 || index >= SIZES) return;
-	if (sizes[index]) sizes[index]->info();
-}
-
-
-int Allocator::sizes_error(int index) {
-	if (index < 0 || index >= SIZES) return -1;
-	if (sizes[index]) return sizes[index]->getErrorCode();
-	else return -1;
-}
-
-
-/*
-int Allocator::cache_shrink(Cache* cachep) {
-	m.lock();
-	for (Cache* c = Cache::getHeadCache(); c != nullptr; c = c->getNextCache()) {
-		if (c == cachep) {
-			m.unlock();
-			return c->shrink();
-		}
-	}
-	m.unlock();
-	return -1;	// Error: cache not found.
-}
-
-
-void* Allocator::cache_alloc(Cache* cachep) {
-	m.lock();
-	for (Cache* c = Cache::getHeadCache(); c != nullptr; c = c->getNextCache()) {
-		if (c == cachep) {
-			m.unlock();
-			return c->alloc();
-		}
-	}
-	m.unlock();
-	return nullptr;	// Error: cache not found.
-}
-
-
-void Allocator::cache_free(Cache* cachep, void* objp) {
-	m.lock();
-	for (Cache* c = Cache::getHeadCache(); c != nullptr; c = c->getNextCache()) {
-		if (c == cachep) {
-			m.unlock();
-			c->free(objp);
-			return;
-		}
-	}
-}
-
-
-void Allocator::cache_destroy(Cache* cachep) {
-	m.lock();
-	for (Cache* c = Cache::getHeadCache(); c != nullptr; c = c->getNextCache()) {
-		if (c == cachep) {
-			c->destroy();
-			break;
-		}
-	}
-	m.unlock();
-	cache_for_caches->free(cachep);
-//	cache_for_handles->free(	//????
-}
-
-
-void Allocator::cache_info(Cache* cachep) {
-	m.lock();
-	for (Cache* c = Cache::getHeadCache(); c != nullptr; c = c->getNextCache()) {
-		if (c == cachep) {
-			m.unlock();
-			c->info();
-			return;
-		}
-	}
-	m.unlock();
-}
-
-
-int Allocator::cache_error(Cache* cachep) {
-	m.lock();
-	for (Cache* c = Cache::getHeadCache(); c != nullptr; c = c->getNextCache()) {
-		if (c == cachep) {
-			m.unlock();
-			return c->error();
-		}
-	}
-	m.unlock();
-	return -1;	// value?
-}
+#include "allocator.h"
+#include "slab class.h"
+#include "memory ops.h"
+#include "epoch.h"
+#include "metrics.h"
+#include <string>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+
+static inline int ceil_log2(size_t x) {	// x > 1
+#ifdef _MSC_VER
+	unsigned long i;
+	_BitScanReverse64(&i, (unsigned long long)(x - 1));
+	return (int)i + 1;
+#else
+	return 64 - __builtin_clzll((unsigned long long)(x - 1));
+#endif
+}
+
+
+void* Allocator::space = nullptr;
+int Allocator::block_num = 0;
+bool Allocator::is_initialized = false;
+bool Allocator::space_zeroed = false;
+bool Allocator::huge_pages = false;
+int Allocator::buddy[] = { 0 };
+int Allocator::lazy_chunks[] = { 0 };
+int Allocator::lazy_limit = BUDDY_LAZY_CHUNKS;
+std::atomic<bool> Allocator::page_cache_on(true);
+long long Allocator::splits = 0;
+long long Allocator::merges = 0;
+block_info* Allocator::blocks_info = nullptr;
+Cache* Allocator::cache_for_handles = nullptr;
+Cache* Allocator::cache_for_caches = nullptr;
+cache_geometry Allocator::geometry = { CACHE_L1_LINE_SIZE, 32 * 1024, 8, 256 * 1024, 4 };
+int Allocator::page_colors = 1;
+std::atomic<Cache*> Allocator::sizes[LIFETIMES][SIZES] = {};	// (zero-initialized: nullptr)
+bool Allocator::merge_caches = false;
+int Allocator::large_slot = -1;
+AdaptiveMutex Allocator::m;
+AdaptiveMutex Allocator::caches_m;
+
+
+// No constructors or destructors here: registering a thread_local destructor calls malloc,
+// which may be this allocator (see malloc shim.cpp), so the lists are drained through a pthread
+// key, set when the first run is kept (as Metrics does for its records).
+struct PageCache {	// runs of each length are linked through block_info::next_free
+	int head[PCP_MAX_BLOCKS + 1];	// first block + 1, 0 if the list is empty
+	int count[PCP_MAX_BLOCKS + 1];
+	bool watched;	// the runs are given back when the thread finishes
+};
+static thread_local PageCache page_cache;
+
+#ifdef __linux__
+static pthread_key_t page_cache_exit_key;
+static pthread_once_t page_cache_exit_once = PTHREAD_ONCE_INIT;
+
+static void watch_page_cache() {
+	page_cache.watched = true;
+	pthread_once(&page_cache_exit_once, []() { pthread_key_create(&page_cache_exit_key, [](void*) { Allocator::drain_page_cache(); }); });
+	pthread_setspecific(page_cache_exit_key, &page_cache);	// (the destructor runs only for a value other than null)
+}
+#else
+struct PageCacheExit {
+	~PageCacheExit() {
+		Allocator::drain_page_cache();
+	}
+};
+static thread_local PageCacheExit page_cache_exit;
+
+static void watch_page_cache() {
+	page_cache.watched = true;
+	PageCacheExit* volatile touched = &page_cache_exit;	// The destructor runs only for threads that have touched it.
+	(void)touched;
+}
+#endif
+
+
+void Allocator::init(void *space, int block_num, bool space_zeroed, bool huge_pages) {
+	std::lock_guard<AdaptiveMutex> guard(caches_m);	// Concurrent calls initialize the allocator only once.
+	if (Allocator::is_initialized) {
+		std::cout << "Allocator has already been initialized!" << std::endl;
+		return;
+	}
+	if (block_num < 0 || block_num >= (1 << N)) {
+		std::cout << "NUMBER OF BLOCKS (" + std::to_string(block_num) + ") EXCEEDING MAXIMUM (2^" + std::to_string(N) + " - 1)" << std::endl;
+		exit(4);
+	}
+
+	// The space is aligned to BLOCK_SIZE and the block map is kept in its first blocks.
+	char* aligned_space = (char*)(((uintptr_t)space + BLOCK_SIZE - 1) & ~(uintptr_t)(BLOCK_SIZE - 1));
+	if (aligned_space != space) --block_num;
+	int info_blocks = (block_num * sizeof(block_info) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (block_num <= info_blocks) {
+		std::cout << "NUMBER OF BLOCKS (" + std::to_string(block_num) + ") TOO SMALL" << std::endl;
+		exit(4);
+	}
+	if (huge_pages) {	// The blocks begin at a huge page, so that chunks of HUGE_PAGE_BLOCKS are huge pages.
+		uintptr_t data = (uintptr_t)aligned_space + (uintptr_t)info_blocks * BLOCK_SIZE;
+		info_blocks += (int)((((data + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1)) - data) / BLOCK_SIZE);
+		if (block_num <= info_blocks) {
+			std::cout << "NUMBER OF BLOCKS (" + std::to_string(block_num) + ") TOO SMALL" << std::endl;
+			exit(4);
+		}
+	}
+	block_num -= info_blocks;
+	blocks_info = (block_info*)aligned_space;
+	if (!space_zeroed) memset(blocks_info, 0, block_num * sizeof(block_info));	// Fresh mmap'ed pages are not touched.
+
+	Allocator::space = aligned_space + info_blocks * BLOCK_SIZE;
+	Allocator::block_num = block_num;
+	Allocator::space_zeroed = space_zeroed;
+	Allocator::huge_pages = huge_pages;
+
+	int i = N - 1;
+	int mask = 1 << (N - 1);
+	int blocks_offset = 0;
+	while (i >= 0) {
+		int blocks_i = block_num & mask;
+		buddy[i] = -1;
+		if (blocks_i) {
+			list_add(blocks_offset, i);
+			blocks_offset += blocks_i;
+		}
+		--i;
+		mask >>= 1;
+	}
+
+	geometry = detect_cache_geometry();
+	size_t l2_way = geometry.l2_size / (geometry.l2_ways > 0 ? geometry.l2_ways : 1);
+	page_colors = (int)(l2_way / BLOCK_SIZE);
+	if (page_colors < 1) page_colors = 1;
+	if (page_colors > MAX_PAGE_COLORS) page_colors = MAX_PAGE_COLORS;
+
+	cache_for_caches = Cache::createCacheForCaches();
+	if (!cache_for_caches) exit(1);	// Fatal error.
+	cache_for_handles = Cache::createCache("CACHE FOR HANDLES", sizeof(kmem_cache_t), nullptr, nullptr);
+	if (!cache_for_handles) exit(2);	// Fatal error.
+
+	// SIZE CACHES ARE CREATED IMPLICITLY WHEN THERE IS NEED TO ALLOCATE A CERTAIN SIZE BUFFER FOR THE FIRST TIME
+
+	large_slot = Metrics::acquireSlot();
+
+	Allocator::is_initialized = true;
+}
+
+
+int Allocator::init_arena(size_t bytes, unsigned flags) {
+	if (is_initialized) {
+		std::cout << "Allocator has already been initialized!" << std::endl;
+		return -1;
+	}
+	size_t max_bytes = ((size_t)(1 << N) - 1) * BLOCK_SIZE;
+	bytes = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);	// (as mapped) Rounded first, so the clamp has the last word.
+	if (bytes > max_bytes) bytes = max_bytes & ~(HUGE_PAGE_SIZE - 1);
+	unsigned backing = 0;
+	void* arena = map_arena(bytes, flags, &backing);
+	if (arena == nullptr) return -1;
+	init(arena, (int)(bytes / BLOCK_SIZE), true, backing != 0);	// Fresh mappings are zero-filled.
+	return (int)backing;
+}
+
+
+int Allocator::page_color(const void* p) {
+	// Virtual addresses stand in for physical ones (exact with huge pages).
+	return (int)(((uintptr_t)p / BLOCK_SIZE) % page_colors);
+}
+
+
+void* Allocator::block(int n) {
+	if (n < 0 || n >= block_num) return nullptr;	// will return nullptr even if allocator is uninitialized because then block_num is 0
+	return (void*)((char*)space + (size_t)n * BLOCK_SIZE);
+}
+
+
+int Allocator::block_index(const void* p) {
+	if ((const char*)p < (char*)space || (const char*)p >= (char*)space + (size_t)block_num * BLOCK_SIZE) return -1;
+	return ((const char*)p - (char*)space) / BLOCK_SIZE;
+}
+
+
+int Allocator::find_buddy(int n, int i) {
+	if (n < 0 || n >= block_num || i < 0 || i >= N) return -1;	// Error: n or i out of range.
+	int size_in_blocks = 1;
+	for (int j = 0; j < i; j++) size_in_blocks *= 2;
+	if (n % size_in_blocks != 0) return -1;	// Error: misaligned n.
+	int chunk_position = n / size_in_blocks;
+	// The code below checks if the block has no buddy (due to block_num not being a power of 2).
+	// A different "error" value is returned (-2, not -1) in case there is no buddy.
+	if (chunk_position % 2 == 0) return (n + size_in_blocks * 2 > block_num) ? -2 : n + size_in_blocks;
+	else return n + size_in_blocks > block_num ? -2 : n - size_in_blocks;
+}
+
+
+int Allocator::buddy_take(int i) {
+	if (i < 0 || i >= N) return -1;	// error
+	// Find the first segment of at least 2^i blocks:
+	int j = i;
+	while (j < N && buddy[j] == -1) j++;
+	if (j == N) {	// Smaller lazy chunks may join into one.
+		if (!coalesce_lazy(i)) return -1;	// Not found, no memory.
+		for (j = i; j < N && buddy[j] == -1; j++);
+		if (j == N) return -1;
+	}
+	int n = buddy[j];	// (the most recently freed chunk, which may still be in the cache)
+	list_remove(n, j);
+	// Divide it into halves until it is 2^i blocks large; the upper halves stay free.
+	while (j > i) {
+		--j;
+		list_add(n + (1 << j), j);
+		splits++;
+	}
+	return n;
+}
+
+
+void* Allocator::buddy_alloc(int i) {
+	std::lock_guard<AdaptiveMutex> guard(m);
+	int n = buddy_take(i);
+	if (n < 0) return nullptr;
+	claim_blocks(n, 1 << i);	// Written from now on: never reported untouched again (see buddy_alloc_exact).
+	return block(n);
+}
+
+
+void* Allocator::buddy_alloc_blocks_required(int blocks) {
+	if (blocks <= 0) return nullptr;	// Error. However, if number of blocks is too large,
+										// the error will be addressed in buddy_alloc(i).
+	int i = 0;
+	for (int n = 1; n < blocks; n *= 2) i++;
+	return buddy_alloc(i);
+}
+
+
+void* Allocator::buddy_alloc_space_required(size_t bytes) {
+	if (bytes == 0 || bytes > ((size_t)BLOCK_SIZE << (N - 1))) return nullptr;	// error
+	int blocks = (int)(bytes / BLOCK_SIZE);
+	if (bytes % BLOCK_SIZE > 0) ++blocks;
+	return buddy_alloc_blocks_required(blocks);
+}
+
+
+void* Allocator::buddy_alloc_exact(int blocks, bool* untouched, int* huge_page) {
+	if (blocks > 0 && blocks <= PCP_MAX_BLOCKS && page_cache.head[blocks] > 0) {	// A warm run, no locking (never kept with huge pages).
+		int n = page_cache.head[blocks] - 1;
+		page_cache.head[blocks] = blocks_info[n].next_free;
+		page_cache.count[blocks]--;
+		if (untouched) *untouched = false;
+		return block(n);
+	}
+	if (blocks <= 0) return nullptr;	// error
+	int i = 0;
+	while ((1 << i) < blocks && i < N) i++;
+	bool pack = huge_pages && huge_page != nullptr && i < HUGE_PAGE_ORDER;
+	std::unique_lock<AdaptiveMutex> lock(m);
+	int n = -1;
+	if (pack) {	// The caller's huge page, then a whole free one; only if there is none, any free chunk.
+		n = huge_page_take(*huge_page, i);
+		if (n < 0 && (n = buddy_take(HUGE_PAGE_ORDER)) >= 0)
+			buddy_put_run(n + (1 << i), HUGE_PAGE_BLOCKS - (1 << i));	// The rest of the huge page stays free for the caller.
+	}
+	if (n < 0) n = buddy_take(i);
+	if (n < 0) {	// The runs kept by this thread may coalesce into a large enough chunk.
+		lock.unlock();
+		drain_page_cache();
+		lock.lock();
+		n = buddy_take(i);
+	}
+	if (n < 0) return nullptr;
+	if ((1 << i) > blocks) buddy_put_run(n + blocks, (1 << i) - blocks);	// Give back the tail.
+	bool zero = claim_blocks(n, blocks);
+	if (pack) *huge_page = n / HUGE_PAGE_BLOCKS;
+	if (untouched) *untouched = zero;
+	return block(n);
+}
+
+
+int Allocator::huge_page_take(int hp, int i) {
+	if (hp < 0) return -1;
+	int first = hp * HUGE_PAGE_BLOCKS;
+	int end = first + HUGE_PAGE_BLOCKS < block_num ? first + HUGE_PAGE_BLOCKS : block_num;
+	int best = -1;
+	for (int n = first; n < end; ) {	// Free chunks are found in the block map, the lists are not searched.
+		int j = blocks_info[n].free_order - 1;
+		if (j < 0) {
+			n++;
+			continue;
+		}
+		if (j >= i && (best < 0 || j < blocks_info[best].free_order - 1)) best = n;
+		n += 1 << j;
+	}
+	if (best < 0) return -1;
+	int j = blocks_info[best].free_order - 1;
+	list_remove(best, j);
+	while (j > i) {	// Split as buddy_take does.
+		--j;
+		list_add(best + (1 << j), j);
+		splits++;
+	}
+	return best;
+}
+
+
+bool Allocator::claim_blocks(int n, int num_of_blocks) {
+	bool zero = space_zeroed;
+	for (int j = n; j < n + num_of_blocks && j < block_num; j++) {
+		if (blocks_info[j].used) zero = false;
+		blocks_info[j].used = true;
+	}
+	return zero;
+}
+
+
+int Allocator::bytes_required_to_blocks_allocated(size_t bytes) {
+	if (bytes == 0 || bytes > ((size_t)BLOCK_SIZE << (N - 1))) return -1;	// error
+	int blocks = (int)(bytes / BLOCK_SIZE);
+	if (bytes % BLOCK_SIZE > 0) ++blocks;
+	int n = 1;
+	while (n < blocks) n *= 2;
+	return n;
+}
+
+
+int Allocator::buddy_put(int n, int i, bool lazy) {
+	if (i < 0 || i >= N) return -1;	// Error: i out of range.
+	if (block(n) == nullptr) return -1;	// Error: illegal block n.
+	if (lazy && lazy_chunks[i] < lazy_limit && find_buddy(n, i) != -1) {	// Kept as it is, even if the buddy is free.
+		list_add(n, i);
+		blocks_info[n].lazy = true;
+		lazy_chunks[i]++;
+		return 0;
+	}
+	for (;;) {
+		int nb = find_buddy(n, i);	// Find the buddy of n.
+		if (nb == -1) return -1;	// Error: mismatching n and i.
+		// Check whether the buddy of block n is free (the block map tells that directly):
+		if (nb == -2 || blocks_info[nb].free_order != i + 1 || i == N - 1) {	// Not free; just add block n to the list buddy[i].
+			list_add(n, i);
+			return 0;
+		}
+		// Found the buddy (lazy or not). Remove it from buddy[i], then join n and nb to one chunk of buddy[i+1]:
+		list_remove(nb, i);
+		if (nb < n) n = nb;
+		i++;
+		merges++;
+	}
+}
+
+
+int Allocator::buddy_free(int n, int i) {
+	std::lock_guard<AdaptiveMutex> guard(m);
+	return buddy_put(n, i, true);
+}
+
+
+bool Allocator::coalesce_lazy(int below) {
+	bool any = false;
+	for (int i = 0; i < below && i < N; i++) {
+		while (lazy_chunks[i] > 0) {	// Joining may take a lazy buddy out of the list, so it is searched again.
+			int n = buddy[i];
+			while (!blocks_info[n].lazy) n = blocks_info[n].next_free;
+			list_remove(n, i);
+			buddy_put(n, i);
+			any = true;
+		}
+	}
+	return any;
+}
+
+
+void Allocator::set_lazy_chunks(int chunks) {
+	std::lock_guard<AdaptiveMutex> guard(m);
+	lazy_limit = chunks < 0 ? 0 : chunks;
+	if (is_initialized) coalesce_lazy(N);	// (they are kept again from now on)
+}
+
+
+void Allocator::buddy_counts(long long* splits, long long* merges) {
+	std::lock_guard<AdaptiveMutex> guard(m);
+	*splits = Allocator::splits;
+	*merges = Allocator::merges;
+}
+
+
+int Allocator::buddy_put_run(int n, int blocks, bool lazy) {
+	int end = n + blocks;
+	while (n < end) {
+		// The largest chunk that begins at n (aligned to its size) and does not pass the end of the run:
+		int i = 0;
+		while (i < N - 1 && n % (2 << i) == 0 && n + (2 << i) <= end) i++;
+		if (buddy_put(n, i, lazy) != 0) return -1;	// error
+		n += 1 << i;
+	}
+	return 0;
+}
+
+
+int Allocator::buddy_free_run(int n, int blocks) {
+	std::lock_guard<AdaptiveMutex> guard(m);
+	return buddy_put_run(n, blocks, true);
+}
+
+
+void Allocator::list_add(int n, int i) {
+	blocks_info[n].free_order = i + 1;
+	blocks_info[n].prev_free = -1;
+	blocks_info[n].next_free = buddy[i];
+	if (buddy[i] > -1) blocks_info[buddy[i]].prev_free = n;
+	buddy[i] = n;
+}
+
+
+void Allocator::list_remove(int n, int i) {
+	block_info& b = blocks_info[n];
+	if (b.prev_free > -1) blocks_info[b.prev_free].next_free = b.next_free;
+	else buddy[i] = b.next_free;
+	if (b.next_free > -1) blocks_info[b.next_free].prev_free = b.prev_free;
+	b.free_order = 0;
+	if (b.lazy) {
+		b.lazy = false;
+		lazy_chunks[i]--;
+	}
+}
+
+
+int Allocator::deallocate(void* space_to_free, int num_of_blocks) {
+	int first_block = block_index(space_to_free);
+	if (first_block < 0) return -1;	// Error: space_to_free does not belong to the allocator.
+	for (int n = first_block; n < first_block + num_of_blocks && n < block_num; n++) {
+		blocks_info[n].slab = nullptr;
+		blocks_info[n].run = 0;
+	}
+	if (num_of_blocks > 0 && num_of_blocks <= PCP_MAX_BLOCKS && !huge_pages && page_cache_on.load(std::memory_order_relaxed)) {	// (a run reused by another cache would split its huge page)
+		if (!page_cache.watched) watch_page_cache();
+		blocks_info[first_block].next_free = page_cache.head[num_of_blocks];
+		page_cache.head[num_of_blocks] = first_block + 1;
+		if (++page_cache.count[num_of_blocks] > PCP_HIGH) page_cache_drain(num_of_blocks, PCP_HIGH - PCP_BATCH);
+		return 0;
+	}
+	return buddy_free_run(first_block, num_of_blocks);	// Slabs need not be 2^i blocks large.
+}
+
+
+void Allocator::page_cache_drain(int blocks, int keep) {
+	int* link = &page_cache.head[blocks];
+	for (int i = 0; i < keep && *link > 0; i++) link = &blocks_info[*link - 1].next_free;	// The newest (warmest) runs stay.
+	int n = *link;
+	*link = 0;
+	if (n == 0) return;
+	std::lock_guard<AdaptiveMutex> guard(m);	// One lock for the whole batch.
+	while (n > 0) {
+		int next = blocks_info[n - 1].next_free;
+		buddy_put_run(n - 1, blocks, true);
+		page_cache.count[blocks]--;
+		n = next;
+	}
+}
+
+
+void Allocator::drain_page_cache() {
+	if (!is_initialized) return;
+	for (int blocks = 1; blocks <= PCP_MAX_BLOCKS; blocks++) page_cache_drain(blocks, 0);
+}
+
+
+void Allocator::set_page_cache(bool enabled) {
+	page_cache_on.store(enabled, std::memory_order_relaxed);
+	if (!enabled) drain_page_cache();	// (other threads give theirs back as they use or end them)
+}
+
+
+int Allocator::buddy_free_chunks(int chunks[N], int* lazy) {
+	std::lock_guard<AdaptiveMutex> guard(m);
+	int free_blocks = 0;
+	if (lazy != nullptr) *lazy = 0;
+	for (int i = 0; i < N; i++) {
+		chunks[i] = 0;
+		for (int n = buddy[i]; n != -1; n = blocks_info[n].next_free) chunks[i]++;
+		free_blocks += chunks[i] << i;
+		if (lazy != nullptr) *lazy += lazy_chunks[i];
+	}
+	return free_blocks;
+}
+
+
+int Allocator::check_buddy() {
+	std::lock_guard<AdaptiveMutex> guard(m);
+	int free_blocks = 0;
+	for (int i = 0; i < N; i++) {
+		int lazy = 0;
+		for (int n = buddy[i], prev = -1; n != -1; prev = n, n = blocks_info[n].next_free) {
+			if (n < 0 || n >= block_num || free_blocks > block_num) return -1;	// (a cycle)
+			if (blocks_info[n].free_order != i + 1 || blocks_info[n].prev_free != prev) return -1;
+			if (n % (1 << i) != 0 || n + (1 << i) > block_num) return -1;
+			int nb = find_buddy(n, i);
+			if (blocks_info[n].lazy) lazy++;
+			else if (i < N - 1 && nb >= 0 && blocks_info[nb].free_order == i + 1 && !blocks_info[nb].lazy) return -1;	// should have been joined
+			for (int j = n; j < n + (1 << i); j++)
+				if (blocks_info[j].slab != nullptr || blocks_info[j].run != 0) return -1;
+			free_blocks += 1 << i;
+		}
+		if (lazy != lazy_chunks[i]) return -1;
+	}
+	return free_blocks;
+}
+
+
+int Allocator::huge_page_of(const void* p) {
+	int n = huge_pages ? block_index(p) : -1;
+	return n < 0 ? -1 : n / HUGE_PAGE_BLOCKS;
+}
+
+
+void Allocator::set_slab(void* first_block, int num_of_blocks, Slab* s) {
+	int first = block_index(first_block);
+	if (first < 0) return;
+	for (int n = first; n < first + num_of_blocks && n < block_num; n++) blocks_info[n].slab = s;
+}
+
+
+Slab* Allocator::slab_of(const void* objp) {
+	int n = block_index(objp);
+	return n < 0 ? nullptr : blocks_info[n].slab;
+}
+
+
+void* Allocator::large_alloc(size_t size, bool* untouched) {
+	int blocks = bytes_required_to_blocks_allocated(size);
+	if (blocks < 0) return nullptr;	// error
+	void* ret = buddy_alloc_exact(blocks, untouched);
+	if (ret == nullptr) {
+		Metrics::count(large_slot, METRIC_FAILURES);
+		return nullptr;
+	}
+	blocks_info[block_index(ret)].run = bytes_required_to_blocks_allocated(size);
+	Metrics::count(large_slot, METRIC_ALLOCS);
+	return ret;
+}
+
+
+bool Allocator::large_free(const void* objp) {
+	int n = block_index(objp);
+	bool ok = n >= 0 && blocks_info[n].run != 0 && block(n) == objp;	// Otherwise objp is not the beginning of a large buffer.
+	ok = ok && deallocate(block(n), blocks_info[n].run) == 0;
+	Metrics::count(large_slot, ok ? METRIC_FREES : METRIC_FAILURES);
+	return ok;
+}
+
+
+bool Allocator::large_resize(const void* objp, size_t size) {
+	int n = block_index(objp);
+	if (n < 0 || blocks_info[n].run == 0 || block(n) != objp) return false;	// Error: objp is not the beginning of a large buffer.
+	if (n % blocks_info[n].run != 0) return false;	// Trimmed by malloc_aligned: its halves are no buddies.
+	int needed = bytes_required_to_blocks_allocated(size);
+	if (needed < 0) return false;
+	std::unique_lock<AdaptiveMutex> lock(m);
+	int run = blocks_info[n].run;
+	if (needed < run) {	// Give back the upper halves.
+		while (run > needed) {
+			run /= 2;
+			int i = 0;
+			for (int blocks = 1; blocks < run; blocks *= 2, i++);
+			buddy_put(n + run, i);
+		}
+		blocks_info[n].run = run;
+		return true;
+	}
+	// Grow only if every buddy up to the required size is free and follows the buffer.
+	int i = 0;
+	for (int blocks = 1; blocks < run; blocks *= 2, i++);
+	for (bool drained = false; ; drained = true) {
+		bool free = true;
+		for (int blocks = run, j = i; free && blocks < needed; blocks *= 2, j++) {
+			int nb = find_buddy(n, j);
+			free = nb == n + blocks && blocks_info[nb].free_order == j + 1;
+		}
+		if (free) break;
+		if (drained || PCP_MAX_BLOCKS == 0) return false;
+		// Small buddies may be parked in the calling thread's page cache.
+		lock.unlock();
+		drain_page_cache();
+		lock.lock();
+	}
+	for (int blocks = run, j = i; blocks < needed; blocks *= 2, j++) list_remove(n + blocks, j);
+	claim_blocks(n + run, needed - run);
+	blocks_info[n].run = needed;
+	return true;
+}
+
+
+void* Allocator::allocateMemoryForCacheCreation() {
+	return cache_for_caches != nullptr ? cache_for_caches->alloc() : nullptr;
+}
+
+
+void Allocator::freeMemoryOfDestroyedCache(Cache* c) {
+	cache_for_caches->free(c);
+}
+
+
+kmem_cache_t* Allocator::cache_create(const char *name, size_t size, void(*ctor)(void *), void(*dtor)(void *), size_t align, unsigned flags) {
+	std::unique_lock<AdaptiveMutex> lock(caches_m);	// Lookups for merging must not race with other creations.
+	bool mergeable = merge_caches && ctor == nullptr && dtor == nullptr && !(flags & (SLAB_NO_MERGE | SLAB_COLOR_PER_THREAD | SLAB_NO_COLOR));
+	Cache* c = nullptr;
+	bool created = false;
+	if (mergeable) {
+		for (Cache* cur = Cache::getHeadCache(); cur != nullptr; cur = cur->getNextCache()) {
+			if (cur->canMergeWith(size, align)) {
+				c = cur;
+				break;
+			}
+		}
+	}
+	if (c == nullptr) {
+		c = Cache::createCache(name, size, ctor, dtor, align, flags);
+		if (c == nullptr) return nullptr;	// error
+		c->setMergeable(mergeable);
+		created = true;
+	}
+	void* loc = cache_for_handles->alloc();
+	if (loc == nullptr) {	// error
+		if (created) {
+			c->destroy();
+			lock.unlock();	// Readers may wait for caches_m (e.g. to create a size-N cache).
+			if (Epoch::waitForReaders() == 0) cache_for_caches->free(c);	// (lookups may have seen it in the registry)
+		}
+		return nullptr;
+	}
+	kmem_cache_t* h = new (loc) kmem_cache_t(c, name, created);	// Placement new!
+	c->addHandle(h);
+	return h;
+}
+
+
+kmem_cache_t* Allocator::cache_find(const char* name) {
+	kmem_cache_t* ret = nullptr;
+	Epoch::enter();
+	for (Cache* c = Cache::getHeadCache(); c != nullptr && ret == nullptr; c = c->getNextCache()) {
+		for (kmem_cache_t* h = c->getFirstHandle(); h != nullptr; h = h->getNextHandle()) {
+			if (strncmp(h->getName(), name, NAME_LENGTH - 1) == 0) {	// Names of handles are truncated the same way.
+				ret = h;
+				break;
+			}
+		}
+	}
+	Epoch::exit();
+	return ret;
+}
+
+
+void Allocator::for_each_cache(void (*fn)(Cache*, void*), void* arg) {
+	Epoch::enter();
+	for (Cache* c = Cache::getHeadCache(); c != nullptr; c = c->getNextCache()) fn(c, arg);
+	Epoch::exit();
+}
+
+
+kmem_cache_t* Allocator::cache_create_movable(const char *name, size_t size, void(*ctor)(void *), void(*dtor)(void *), int(*relocate)(void *, void *)) {
+	if (relocate == nullptr) return nullptr;	// error
+	kmem_cache_t* h = cache_create(name, size, ctor, dtor, 1, SLAB_NO_MERGE);
+	if (h != nullptr) h->c->setRelocator(relocate);	// (a new cache, no other thread knows it yet)
+	return h;
+}
+
+
+void Allocator::set_cache_merging(bool enabled) {
+	merge_caches = enabled;
+}
+
+
+int Allocator::size_index(size_t size) {
+	if (size == 0 || size > MAX_SIZE_BYTES) return -1;
+	if (size <= MIN_SIZE_POWER_OF_2_BYTES) return 0;
+	return ceil_log2(size) - ceil_log2(MIN_SIZE_POWER_OF_2_BYTES);	// size-N caches are consecutive powers of 2
+}
+
+
+Cache* Allocator::size_cache(int i, int lifetime) {
+	static const char* suffixes[LIFETIMES] = { "", "-short", "-long", "-perm" };
+	Cache* c = sizes[lifetime][i].load(std::memory_order_acquire);	// (pairs with the release below: the cache is fully built)
+	if (!c) {
+		// Create size-N cache if one does not exist.
+		std::lock_guard<AdaptiveMutex> guard(caches_m);	// Two threads must not create the same cache.
+		c = sizes[lifetime][i].load(std::memory_order_relaxed);
+		if (!c) {
+			size_t upper_limit = (size_t)MIN_SIZE_POWER_OF_2_BYTES << i;
+			char s[NAME_LENGTH];
+			snprintf(s, NAME_LENGTH, "size-%zu%s", upper_limit, suffixes[lifetime]);	// No std::string, malloc may be the C runtime's.
+			c = Cache::createCache(s, upper_limit, nullptr, nullptr);
+			sizes[lifetime][i].store(c, std::memory_order_release);
+		}
+	}
+	return c;
+}
+
+
+int Allocator::size_lifetime(const Cache* c, int i) {
+	if (i < 0) return -1;
+	for (int l = 0; l < LIFETIMES; l++)
+		if (sizes[l][i].load(std::memory_order_acquire) == c) return l;
+	return -1;
+}
+
+
+void* Allocator::malloc(size_t size) {
+	int i = size_index(size);
+	if (i < 0) return size > 0 ? large_alloc(size) : nullptr;
+	Cache* c = size_cache(i);
+	return c != nullptr ? c->alloc() : nullptr;
+}
+
+
+void* Allocator::malloc_hint(size_t size, unsigned flags) {
+	int i = size_index(size);
+	if (i < 0) return size > 0 ? large_alloc(size) : nullptr;	// Large buffers have blocks of their own anyway.
+	Cache* c = size_cache(i, flags & KMALLOC_LIFETIME_MASK);
+	return c != nullptr ? c->alloc() : nullptr;
+}
+
+
+void* Allocator::zmalloc(size_t size) {
+	int i = size_index(size);
+	if (i < 0) {
+		if (size == 0) return nullptr;
+		bool untouched = false;
+		void* p = large_alloc(size, &untouched);
+		if (p != nullptr && !untouched) zero_memory(p, size);	// Pages of a fresh mmap'ed space are already zero.
+		return p;
+	}
+	Cache* c = size_cache(i);
+	return c != nullptr ? c->alloc(true, true) : nullptr;
+}
+
+
+void* Allocator::malloc_aligned(size_t size, size_t alignment) {
+	if (alignment <= KMALLOC_ALIGNMENT) return malloc(size);
+	if ((alignment & (alignment - 1)) != 0) return nullptr;	// Error: alignment is not a power of 2.
+	if (alignment > BLOCK_SIZE) {
+		// Chunks of 2^i blocks are aligned to their size only relative to the space, which need not be
+		// aligned that much (see init), so a run larger by the alignment is taken and trimmed.
+		int blocks = bytes_required_to_blocks_allocated(size);
+		int extra = (int)(alignment / BLOCK_SIZE) - 1;
+		if (blocks < 0 || (size_t)blocks + extra >= ((size_t)1 << N)) return nullptr;	// error
+		void* p = buddy_alloc_exact(blocks + extra);
+		if (p == nullptr) {
+			Metrics::count(large_slot, METRIC_FAILURES);
+			return nullptr;
+		}
+		int n = block_index(p);
+		int a = block_index((void*)(((uintptr_t)p + alignment - 1) & ~(uintptr_t)(alignment - 1)));
+		if (a > n) buddy_free_run(n, a - n);
+		if (n + extra > a) buddy_free_run(a + blocks, n + extra - a);
+		blocks_info[a].run = blocks;
+		Metrics::count(large_slot, METRIC_ALLOCS);
+		return block(a);
+	}
+	// A buffer that is larger by the difference always contains an aligned one;
+	// freeing it through the inner pointer works because slots are found by division.
+	char* p = (char*)malloc(size + alignment - KMALLOC_ALIGNMENT);
+	if (p == nullptr) return nullptr;
+	return (void*)(((uintptr_t)p + alignment - 1) & ~(uintptr_t)(alignment - 1));
+}
+
+
+void Allocator::free(const void* objp) {
+	Slab* s = slab_of(objp);
+	if (s == nullptr) {	// Not a size-N buffer, it may be a large one.
+		large_free(objp);
+		return;
+	}
+	Cache* c = s->getOwner();
+	int lifetime = size_lifetime(c, size_index(s->getSlotSize()));
+	if (lifetime >= 0 && c->free((void*)objp) == true && lifetime != KMALLOC_PERMANENT)
+		c->shrink(false);	// It is neccessary to shrink sizes here because it cannot be done from outside.
+							// Also - FORCE SHRINK? (Create special shrink method that cannot be avoided - see Cache::shrink()).
+}
+
+
+void Allocator::free_sized(const void* objp, size_t size, size_t alignment) {
+	if (objp == nullptr) return;
+	if (alignment > BLOCK_SIZE) {
+		large_free(objp);
+		return;
+	}
+	if (alignment > KMALLOC_ALIGNMENT) size += alignment - KMALLOC_ALIGNMENT;	// See malloc_aligned().
+	int i = size_index(size);
+	if (i < 0) {
+#ifdef KMEM_DEBUG
+		if (slab_of(objp) != nullptr) {
+			std::cout << "SIZE " + std::to_string(size) + " DOES NOT MATCH THE FREED BUFFER!" << std::endl;
+			free(objp);
+			return;
+		}
+#endif
+		large_free(objp);
+		return;
+	}
+	// The size gives the size-N caches, the block map tells which lifetime's cache owns the buffer.
+	Slab* s = slab_of(objp);
+	Cache* c = s != nullptr ? s->getOwner() : nullptr;
+	int lifetime = size_lifetime(c, i);
+	if (lifetime < 0) {
+#ifdef KMEM_DEBUG
+		std::cout << "SIZE " + std::to_string(size) + " DOES NOT MATCH THE FREED BUFFER!" << std::endl;
+		free(objp);
+#endif
+		return;
+	}
+	if (c->free((void*)objp) == true && lifetime != KMALLOC_PERMANENT)
+		c->shrink(false);
+}
+
+
+size_t Allocator::usable_size(const void* objp) {
+	Slab* s = slab_of(objp);
+	if (s != nullptr) return s->usableSize(objp);
+	int n = block_index(objp);
+	if (n < 0 || blocks_info[n].run == 0 || block(n) != objp) return 0;	// Not allocated here.
+	return (size_t)blocks_info[n].run * BLOCK_SIZE;
+}
+
+
+void* Allocator::realloc(void* objp, size_t size) {
+	if (objp == nullptr) return malloc(size);
+	if (size == 0) {
+		free(objp);
+		return nullptr;
+	}
+	size_t usable = usable_size(objp);
+	if (usable == 0) return nullptr;	// Error: objp was not allocated here.
+	Slab* s = slab_of(objp);
+	int lifetime = 0;
+	if (s != nullptr) {
+		if (size <= usable && size_index(size) == size_index(s->getSlotSize())) return objp;	// Same size-N cache.
+		lifetime = size_lifetime(s->getOwner(), size_index(s->getSlotSize()));
+		if (lifetime < 0) lifetime = 0;
+	}
+	else if (size > MAX_SIZE_BYTES && large_resize(objp, size)) return objp;
+	void* ret = malloc_hint(size, lifetime);	// The buffer keeps its lifetime hint.
+	if (ret == nullptr) return nullptr;
+	memcpy(ret, objp, usable < size ? usable : size);
+	free(objp);
+	return ret;
+}
+
+
+void Allocator::cache_destroy(kmem_cache_t* cachep) {
+	Cache* c = cachep->c;
+	if (c == nullptr) exit(3);
+	std::unique_lock<AdaptiveMutex> lock(caches_m);
+	bool last = c->removeHandle(cachep) == 0;	// Otherwise other handles still use the (merged) cache.
+	if (last) c->destroy();
+	lock.unlock();	// Readers may wait for caches_m (e.g. to create a size-N cache).
+	// Lookups and iterations that are still running may be on the handle or the cache.
+	if (Epoch::waitForReaders() < 0) {
+		std::cout << "CACHE DESTROYED INSIDE AN EPOCH CRITICAL SECTION, ITS MEMORY IS LEAKED!" << std::endl;
+		return;
+	}
+	cachep->c = nullptr;
+	Metrics::releaseSlot(cachep->metricsSlot);
+	cache_for_handles->free(cachep);
+	if (last) cache_for_caches->free(c);
+}
+
+
+void Allocator::sizes_info(int index) {
+	if (index < 0 || index >= SIZES) return;
+	for (int l = 0; l < LIFETIMES; l++)
+		if (Cache* c = sizes[l][index].load(std::memory_order_acquire)) c->info();
+}
+
+
+int Allocator::sizes_error(int index) {
+	if (index < 0 || index >= SIZES) return -1;
+	if (Cache* c = sizes[0][index].load(std::memory_order_acquire)) return c->getErrorCode();
+	else return -1;
+}
+
+
+/*
+int Allocator::cache_shrink(Cache* cachep) {
+	m.lock();
+	for (Cache* c = Cache::getHeadCache(); c != nullptr; c = c->getNextCache()) {
+		if (c == cachep) {
+			m.unlock();
+			return c->shrink();
+		}
+	}
+	m.unlock();
+	return -1;	// Error: cache not found.
+}
+
+
+void* Allocator::cache_alloc(Cache* cachep) {
+	m.lock();
+	for (Cache* c = Cache::getHeadCache(); c != nullptr; c = c->getNextCache()) {
+		if (c == cachep) {
+			m.unlock();
+			return c->alloc();
+		}
+	}
+	m.unlock();
+	return nullptr;	// Error: cache not found.
+}
+
+
+void Allocator::cache_free(Cache* cachep, void* objp) {
+	m.lock();
+	for (Cache* c = Cache::getHeadCache(); c != nullptr; c = c->getNextCache()) {
+		if (c == cachep) {
+			m.unlock();
+			c->free(objp);
+			return;
+		}
+	}
+}
+
+
+void Allocator::cache_destroy(Cache* cachep) {
+	m.lock();
+	for (Cache* c = Cache::getHeadCache(); c != nullptr; c = c->getNextCache()) {
+		if (c == cachep) {
+			c->destroy();
+			break;
+		}
+	}
+	m.unlock();
+	cache_for_caches->free(cachep);
+//	cache_for_handles->free(	//????
+}
+
+
+void Allocator::cache_info(Cache* cachep) {
+	m.lock();
+	for (Cache* c = Cache::getHeadCache(); c != nullptr; c = c->getNextCache()) {
+		if (c == cachep) {
+			m.unlock();
+			c->info();
+			return;
+		}
+	}
+	m.unlock();
+}
+
+
+int Allocator::cache_error(Cache* cachep) {
+	m.lock();
+	for (Cache* c = Cache::getHeadCache(); c != nullptr; c = c->getNextCache()) {
+		if (c == cachep) {
+			m.unlock();
+			return c->error();
+		}
+	}
+	m.unlock();
+	return -1;	// value?
+}
 */
\ No newline at end of file
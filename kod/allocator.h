@@ -1,64 +1,191 @@
-#pragma once
-
-
-#include <mutex>
-#include "slab.h"
-#include "cache.h"
-
-
-class Cache;
-
-
-#define N (10)	// 2^N - 1 is the maximum number of blocks for the allocator
-				// 2^(N-1) is the maximum number of blocks one chunk of memory can take
-#define SIZES (13)
-#define MIN_SIZE_POWER_OF_2_BYTES (32)
-
-
-class Allocator {
-private:
-	static void* space;
-	static int block_num;
-
-	static bool is_initialized;
-
-	static int buddy[N];
-
-	static Cache* cache_for_handles;
-	static Cache* cache_for_caches;
-	static Cache* sizes[SIZES];
-
-	Allocator() {}	// makes the class practically static
-
-	static std::recursive_mutex m;
-public:
-	static void init(void *space, int block_num);
-
-	static void* block(int n);
-	static int find_buddy(int n, int i);	// returns the position of the first block of 
-											// the buddy of the memory chunk that begins 
-											// with block number n and is 2^i blocks large;
-											// returns -1 if n is not an appropriate position for the first block
-	static void* buddy_alloc(int i);	// returns 2^i continual blocks
-	static void* buddy_alloc_blocks_required(int blocks);	// accepts total number of blocks as argument
-	static void* buddy_alloc_space_required(int bytes);
-	static int bytes_required_to_blocks_allocated(int bytes);
-	static int buddy_free(int n, int i);
-	static int deallocate(void* space_to_free, int num_of_blocks);
-
-	static void* allocateMemoryForCacheCreation();
-
-	static kmem_cache_t* cache_create(const char *name, size_t size, void(*ctor)(void *), void(*dtor)(void *));
-/*	static int cache_shrink(Cache* cachep);
-	static void* cache_alloc(Cache* cachep);
-	static void cache_free(Cache* cachep, void* objp);*/
-	static void* malloc(size_t size);
-	static void free(const void* objp);
-	static void cache_destroy(kmem_cache_t* cachep);
-/*	static void cache_destroy(Cache* cachep);
-	static void cache_info(Cache* cachep);
-	static int cache_error(Cache* cachep);*/
-
-	static void sizes_info(int index);	// Returns info for size-N.
-	static int sizes_error(int index);	// Returns size-N error code.
+#pragma once
+
+
+#include <mutex>
+#include <atomic>
+#include <cstddef>
+#include "slab.h"
+#include "cache.h"
+#include "lock.h"
+#include "memory ops.h"
+
+
+class Cache;
+class Slab;
+
+
+#define N (20)	// 2^N - 1 is the maximum number of blocks for the allocator
+				// 2^(N-1) is the maximum number of blocks one chunk of memory can take
+#define SIZES (13)
+#define MIN_SIZE_POWER_OF_2_BYTES (32)
+#define MAX_SIZE_BYTES ((size_t)MIN_SIZE_POWER_OF_2_BYTES << (SIZES - 1))	// larger buffers are taken directly from the buddy allocator
+#define KMALLOC_ALIGNMENT (16)	// alignment of every buffer returned by malloc
+#define LIFETIMES (4)	// size-N caches of each lifetime hint (KMALLOC_LIFETIME_MASK), 0 for buffers without one
+
+// Freed runs of up to PCP_MAX_BLOCKS blocks are kept in per-thread lists (like Linux per-cpu pages)
+// and reused without Allocator::m; a list that grows over PCP_HIGH runs gives PCP_BATCH of them back.
+#ifndef PCP_MAX_BLOCKS
+#define PCP_MAX_BLOCKS (8)	// 0 turns the lists off
+#endif
+#define PCP_HIGH (8)
+#define PCP_BATCH (4)
+
+// Lazy buddy system (Barkley and Lee): up to BUDDY_LAZY_CHUNKS freed chunks of each order are kept
+// in their list without being joined to their buddies, so a slab of the same order that is created
+// again takes one back with no split. They are joined only when an allocation finds no chunk that is
+// large enough (see buddy_take).
+#ifndef BUDDY_LAZY_CHUNKS
+#define BUDDY_LAZY_CHUNKS (4)	// 0 joins every freed chunk at once
+#endif
+
+// With a huge page arena (init_arena), slabs of a cache are taken from huge pages of its own:
+// a new huge page is only split when the current one has no room (see buddy_alloc_exact).
+#define HUGE_PAGE_BLOCKS ((int)(HUGE_PAGE_SIZE / BLOCK_SIZE))
+#define HUGE_PAGE_ORDER (9)	// 2^HUGE_PAGE_ORDER == HUGE_PAGE_BLOCKS
+
+#if defined(_DEBUG) && !defined(KMEM_DEBUG)
+#define KMEM_DEBUG	// sizes given to free_sized() are checked against the owning slab
+#endif
+
+
+struct block_info {
+	Slab* slab;	// slab that occupies the block, nullptr if the block is free or belongs to a large buffer
+	int run;	// number of blocks of the large buffer that begins with this block, 0 otherwise
+	int free_order;	// i + 1 if the block begins a free chunk of 2^i blocks, 0 otherwise
+	int next_free;	// neighbours in the list buddy[i] (instead of links kept in the free blocks themselves)
+	int prev_free;
+	bool used;	// the block has been handed out since init() (blocks of a zeroed space are zero until then)
+	bool lazy;	// the block begins a free chunk that is not joined to its buddy (see BUDDY_LAZY_CHUNKS)
+};
+
+
+class Allocator {
+private:
+	static void* space;
+	static int block_num;
+
+	static bool is_initialized;
+	static bool space_zeroed;	// the space was zero-filled when it was given to init()
+	static bool huge_pages;	// the space is backed by huge pages, chunks of HUGE_PAGE_BLOCKS are aligned to them
+
+	static int buddy[N];
+	static int lazy_chunks[N];	// lazy chunks in buddy[i]
+	static int lazy_limit;
+	static std::atomic<bool> page_cache_on;	// see set_page_cache
+	static long long splits;	// chunks divided in halves and buddies joined, under m
+	static long long merges;
+
+	static block_info* blocks_info;	// one entry per block, kept at the beginning of the given space
+
+	static Cache* cache_for_handles;
+	static Cache* cache_for_caches;
+	static std::atomic<Cache*> sizes[LIFETIMES][SIZES];	// created on first use (size_cache), read without locks
+
+	static bool merge_caches;
+	static int large_slot;	// Metrics slot of large buffers
+
+	static cache_geometry geometry;	// detected by init()
+	static int page_colors;	// blocks in one way of the L2 cache, at most MAX_PAGE_COLORS
+
+	Allocator() {}	// makes the class practically static
+
+	static void list_add(int n, int i);	// adds the chunk that begins with block n to the list buddy[i]
+	static void list_remove(int n, int i);
+
+	// The same as buddy_alloc, buddy_free and buddy_free_run, for callers that hold m:
+	static int buddy_take(int i);	// returns the first block of the chunk, -1 if there is none
+	static int buddy_put(int n, int i, bool lazy = false);	// lazy: freed memory, kept unjoined if the order has room
+	static int buddy_put_run(int n, int blocks, bool lazy = false);
+	static bool coalesce_lazy(int below);	// joins the lazy chunks of orders below the given one, returns false if there were none
+	static int huge_page_take(int hp, int i);	// the smallest free chunk of at least 2^i blocks within huge page hp, -1 if there is none
+
+	static bool claim_blocks(int n, int num_of_blocks);	// marks blocks as used, returns true if they were all still zero
+	static void page_cache_drain(int blocks, int keep);	// gives back all but the newest keep runs of the calling thread
+	static Cache* size_cache(int i, int lifetime = 0);	// creates size-N caches on first use
+	static int size_lifetime(const Cache* c, int i);	// returns the lifetime of the size-N cache c, -1 if c is not one
+
+	static AdaptiveMutex m;	// buddy lists and the block map; the innermost lock, nothing else is locked while it is held
+	static AdaptiveMutex caches_m;	// creation and destruction of caches
+public:
+	static void init(void *space, int block_num, bool space_zeroed = false, bool huge_pages = false);	// space_zeroed skips clearing the block map
+	static int init_arena(size_t bytes, unsigned flags);	// maps the space (KMEM_ARENA_* flags), returns the pages obtained, -1 on failure
+
+	inline static bool initialized() {
+		return is_initialized;
+	}
+
+	inline static int blocks() {
+		return block_num;
+	}
+
+	inline static int large_metrics_slot() {
+		return large_slot;
+	}
+
+	inline static size_t line_size() {
+		return geometry.line_size;
+	}
+	static int page_color(const void* p);	// blocks of the same page color map to the same L2 sets
+	inline static const cache_geometry& cache_geometry_info() {
+		return geometry;
+	}
+
+	static void* block(int n);
+	static int block_index(const void* p);	// returns the number of the block that contains p, -1 if p is outside of the allocator's space
+	static int find_buddy(int n, int i);	// returns the position of the first block of 
+											// the buddy of the memory chunk that begins 
+											// with block number n and is 2^i blocks large;
+											// returns -1 if n is not an appropriate position for the first block
+	static void* buddy_alloc(int i);	// returns 2^i continual blocks
+	static void* buddy_alloc_blocks_required(int blocks);	// accepts total number of blocks as argument
+	static void* buddy_alloc_space_required(size_t bytes);
+	static void* buddy_alloc_exact(int blocks, bool* untouched = nullptr, int* huge_page = nullptr);	// returns exactly the given number of continual blocks; the rest of the 2^i chunk is freed
+																		// untouched is set if the blocks are known to be zero
+																		// huge_page: the caller's current huge page (-1 for none), updated
+	static int bytes_required_to_blocks_allocated(size_t bytes);
+	static int buddy_free(int n, int i);
+	static int buddy_free_run(int n, int blocks);	// frees any run of blocks as chunks of 2^i blocks aligned to their size
+	static int deallocate(void* space_to_free, int num_of_blocks);
+	static void drain_page_cache();	// returns the runs kept by the calling thread to the buddy lists
+	static void set_page_cache(bool enabled);	// false: freed runs go straight to the buddy lists (the calling thread's kept ones too)
+	static int buddy_free_chunks(int chunks[N], int* lazy = nullptr);	// counts the free chunks of each order (lazy: those kept unjoined), returns the number of free blocks
+	static void buddy_counts(long long* splits, long long* merges);
+	static void set_lazy_chunks(int chunks);	// lazy chunks kept per order (BUDDY_LAZY_CHUNKS), 0 joins the kept ones
+	static int check_buddy();	// returns the number of free blocks, -1 if a list is broken, a chunk is misaligned or in use, or two free buddies (neither lazy) are not joined
+	static int huge_page_of(const void* p);	// -1 if p is outside of the space or the space has no huge pages
+
+	static void set_slab(void* first_block, int num_of_blocks, Slab* s);
+	static Slab* slab_of(const void* objp);	// returns the slab that objp belongs to, nullptr if there is none
+
+	static void* large_alloc(size_t size, bool* untouched = nullptr);
+	static bool large_free(const void* objp);
+	static bool large_resize(const void* objp, size_t size);	// shrinks or grows (only if the following buddies are free) in place
+
+	static void* allocateMemoryForCacheCreation();
+	static void freeMemoryOfDestroyedCache(Cache* c);
+
+	static kmem_cache_t* cache_create(const char *name, size_t size, void(*ctor)(void *), void(*dtor)(void *), size_t align = 1, unsigned flags = 0);
+	static kmem_cache_t* cache_create_movable(const char *name, size_t size, void(*ctor)(void *), void(*dtor)(void *), int(*relocate)(void *, void *));	// never merged
+	static void set_cache_merging(bool enabled);
+	static kmem_cache_t* cache_find(const char* name);	// returns the handle with the given name, nullptr if there is none
+	static void for_each_cache(void (*fn)(Cache*, void*), void* arg);	// fn runs in an epoch critical section and must not create or destroy caches
+/*	static int cache_shrink(Cache* cachep);
+	static void* cache_alloc(Cache* cachep);
+	static void cache_free(Cache* cachep, void* objp);*/
+	static int size_index(size_t size);	// returns the index of the size-N cache for size, -1 if size is 0 or too large
+	static void* malloc(size_t size);
+	static void* zmalloc(size_t size);	// zeroed buffer
+	static void* malloc_hint(size_t size, unsigned flags);	// flags: KMALLOC_* lifetime hint
+	static void* malloc_aligned(size_t size, size_t alignment);
+	static void free(const void* objp);
+	static void free_sized(const void* objp, size_t size, size_t alignment = KMALLOC_ALIGNMENT);	// size (and alignment) must match the allocation
+	static size_t usable_size(const void* objp);	// returns 0 if objp was not allocated by malloc
+	static void* realloc(void* objp, size_t size);	// in place within the size-N cache or the block run (growing into free buddies), otherwise moved
+	static void cache_destroy(kmem_cache_t* cachep);
+/*	static void cache_destroy(Cache* cachep);
+	static void cache_info(Cache* cachep);
+	static int cache_error(Cache* cachep);*/
+
+	static void sizes_info(int index);	// Returns info for size-N.
+	static int sizes_error(int index);	// Returns size-N error code.
 };
\ No newline at end of file
@@ -0,0 +1,750 @@
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <memory_resource>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <random>
+#include <algorithm>
+#include <thread>
+#include <cstring>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <set>
+#include <map>
+
+#include "benchmark.h"
+#include "memory resource.h"
+#include "slab class.h"
+#include "cache.h"
+#include "allocator.h"
+#include "metrics.h"
+
+
+
+template <class F>
+static double measure_ms(F f) {
+	auto start = std::chrono::steady_clock::now();
+	f();
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+
+static void run_pmr_containers(std::pmr::memory_resource* res, int elements, int rounds, double results[3]) {
+	results[0] = measure_ms([&]() {
+		for (int r = 0; r < rounds; r++) {
+			std::pmr::vector<int> v(res);
+			for (int i = 0; i < elements; i++) v.push_back(i);
+		}
+	});
+	results[1] = measure_ms([&]() {
+		for (int r = 0; r < rounds; r++) {
+			std::pmr::unordered_map<int, int> m(res);
+			for (int i = 0; i < elements; i++) m[i] = i;
+			for (int i = 0; i < elements; i++) m.erase(i);
+		}
+	});
+	results[2] = measure_ms([&]() {
+		for (int r = 0; r < rounds; r++) {
+			std::pmr::list<int> l(res);
+			for (int i = 0; i < elements; i++) l.push_back(i);
+			while (!l.empty()) l.pop_front();
+		}
+	});
+}
+
+
+void benchmark_pmr_containers(int elements, int rounds) {
+	double def[3], kmem[3];
+	run_pmr_containers(std::pmr::new_delete_resource(), elements, rounds, def);
+	run_pmr_containers(kmem_resource(), elements, rounds, kmem);
+
+	double stl = measure_ms([&]() {
+		for (int r = 0; r < rounds; r++) {
+			std::vector<int, KmemAllocator<int>> v;
+			for (int i = 0; i < elements; i++) v.push_back(i);
+		}
+	});
+
+	const char* names[3] = { "vector", "unordered_map", "list" };
+	std::cout << "pmr containers, " << elements << " elements x " << rounds << " rounds (ms)" << std::endl;
+	std::cout << std::setw(16) << "" << std::setw(12) << "default" << std::setw(12) << "kmem" << std::endl;
+	std::cout << std::fixed << std::setprecision(2);
+	for (int i = 0; i < 3; i++)
+		std::cout << std::setw(16) << names[i] << std::setw(12) << def[i] << std::setw(12) << kmem[i] << std::endl;
+	std::cout << std::setw(16) << "KmemAllocator" << std::setw(12) << "" << std::setw(12) << stl << std::endl;
+}
+
+
+void benchmark_churn(size_t objectSize, int liveObjects, int phases) {
+	kmem_cache_t* cache = kmem_cache_create("churn", objectSize, nullptr, nullptr);
+	std::vector<void*> live;
+	std::mt19937 rng(12345);
+	int steadySlabs = 0;
+
+	double ms = measure_ms([&]() {
+		for (int phase = 0; phase < phases; phase++) {
+			while ((int)live.size() < liveObjects) live.push_back(kmem_cache_alloc(cache));
+			// Free three quarters of the objects, chosen at random.
+			std::shuffle(live.begin(), live.end(), rng);
+			while ((int)live.size() > liveObjects / 4) {
+				kmem_cache_free(cache, live.back());
+				live.pop_back();
+			}
+			// Steady churn: replace random objects, as many times as there are objects at peak.
+			for (int i = 0; i < liveObjects; i++) {
+				size_t victim = rng() % live.size();
+				kmem_cache_free(cache, live[victim]);
+				live[victim] = kmem_cache_alloc(cache);
+			}
+			kmem_cache_shrink(cache);
+			steadySlabs = cache->numOfSlabs();
+		}
+	});
+
+	std::cout << "churn, " << objectSize << " B objects, " << liveObjects << " live at peak, " << phases << " phases" << std::endl;
+	std::cout << "  peak slabs: " << cache->peakNumOfSlabs() << std::endl;
+	std::cout << "  slabs after shrinking to " << liveObjects / 4 << " live: " << steadySlabs << std::endl;
+	std::cout << std::fixed << std::setprecision(2) << "  time: " << ms << " ms" << std::endl;
+
+	for (void* p : live) kmem_cache_free(cache, p);
+	kmem_cache_destroy(cache);
+}
+
+
+void benchmark_alloc_order(size_t objectSize, int objects, int rounds) {
+	kmem_cache_t* cache = kmem_cache_create("alloc order", objectSize, nullptr, nullptr);
+	std::vector<void*> live(objects);
+	std::mt19937 rng(12345);
+	double allocMs = 0;
+	double ms = measure_ms([&]() {
+		for (int r = 0; r < rounds; r++) {
+			allocMs += measure_ms([&]() {
+				for (int i = 0; i < objects; i++) {
+					live[i] = kmem_cache_alloc(cache);
+					*(long*)live[i] = i;	// The caller's first write.
+				}
+			});
+			std::shuffle(live.begin(), live.end(), rng);	// Frees in random order scramble LIFO free lists.
+			for (void* p : live) kmem_cache_free(cache, p);
+		}
+	});
+	std::cout << "alloc order, " << objectSize << " B objects, " << objects << " allocated and freed at random x " << rounds << std::endl;
+	std::cout << std::fixed << std::setprecision(2) << "  alloc + first write: " << allocMs * 1e6 / ((double)objects * rounds) << " ns, total " << ms << " ms" << std::endl;
+	kmem_cache_destroy(cache);
+}
+
+
+void benchmark_lifetimes(size_t size, int objects, int longLivedEvery) {
+	std::cout << "lifetimes, " << size << " B buffers, " << objects << " allocated, every " << longLivedEvery << "th is long-lived" << std::endl;
+	for (int hinted = 0; hinted < 2; hinted++) {
+		std::vector<void*> shortLived, longLived;
+		for (int i = 0; i < objects; i++) {
+			bool isLong = i % longLivedEvery == 0;
+			void* p = hinted ? kmalloc_hint(size, isLong ? KMALLOC_LONG_LIVED : KMALLOC_SHORT_LIVED) : kmalloc(size);
+			(isLong ? longLived : shortLived).push_back(p);
+		}
+		for (void* p : shortLived) kfree(p);
+		std::vector<Slab*> pinned;	// slabs that the long-lived buffers keep from being reclaimed
+		for (void* p : longLived) pinned.push_back(Allocator::slab_of(p));
+		std::sort(pinned.begin(), pinned.end());
+		size_t slabs = std::unique(pinned.begin(), pinned.end()) - pinned.begin();
+		size_t blocks = slabs * (pinned.empty() ? 0 : pinned[0]->getNumOfBlocks());
+		std::cout << (hinted ? "  kmalloc_hint: " : "  kmalloc:      ") << longLived.size() << " live buffers keep " << slabs << " slabs (" << blocks << " blocks)" << std::endl;
+		for (void* p : longLived) kfree(p);
+	}
+}
+
+
+void benchmark_realloc(size_t maxSize, int growthPercent, int rounds) {
+	std::cout << "realloc, buffers grown by " << growthPercent << "% up to " << maxSize / 1024 << " KB, " << rounds << " rounds" << std::endl;
+	for (int inPlace = 0; inPlace < 2; inPlace++) {
+		long steps = 0, moves = 0;
+		double ms = measure_ms([&]() {
+			for (int r = 0; r < rounds; r++) {
+				size_t size = 64;
+				char* buf = (char*)kmalloc(size);
+				memset(buf, 1, size);
+				while (size < maxSize) {
+					size_t grown = size + size * growthPercent / 100;
+					char* p;
+					if (inPlace) p = (char*)krealloc(buf, grown);
+					else if ((p = (char*)kmalloc(grown)) != nullptr) {
+						memcpy(p, buf, size);
+						kfree(buf);
+					}
+					if (p == nullptr) break;	// (not enough space)
+					memset(p + size, 1, grown - size);	// The new part is written, like an appending caller would.
+					moves += p != buf;
+					steps++;
+					buf = p;
+					size = grown;
+				}
+				kfree(buf);
+			}
+		});
+		std::cout << std::fixed << std::setprecision(2) << (inPlace ? "  krealloc:               " : "  kmalloc + copy + kfree: ")
+			<< moves << " of " << steps << " steps moved the buffer, " << ms << " ms" << std::endl;
+	}
+}
+
+
+static std::vector<long*>* compaction_table;	// owners of the objects: each object keeps its index in the table
+
+static int relocate_indexed(void* from, void* to) {
+	memcpy(to, from, sizeof(long));
+	(*compaction_table)[*(long*)from] = (long*)to;
+	return 1;
+}
+
+
+void benchmark_compaction(size_t objectSize, int objects, int keepPercent) {
+	kmem_cache_t* cache = kmem_cache_create_movable("movable", objectSize, nullptr, nullptr, relocate_indexed);
+	std::vector<long*> table(objects);
+	compaction_table = &table;
+	for (int i = 0; i < objects; i++) {
+		table[i] = (long*)kmem_cache_alloc(cache);
+		*table[i] = i;
+	}
+	std::mt19937 rng(12345);
+	for (int i = 0; i < objects; i++) {
+		if ((int)(rng() % 100) < keepPercent) continue;
+		kmem_cache_free(cache, table[i]);
+		table[i] = nullptr;
+	}
+	int before = cache->numOfSlabs();
+	kmem_cache_shrink(cache);
+	int shrunk = cache->numOfSlabs();
+	int blocks = 0;
+	double ms = measure_ms([&]() { blocks = kmem_cache_compact(cache); });
+	int compacted = cache->numOfSlabs();
+	bool ok = true;
+	for (int i = 0; i < objects; i++) {
+		if (table[i] == nullptr) continue;
+		ok = ok && *table[i] == i;
+		kmem_cache_free(cache, table[i]);
+	}
+	std::cout << "compaction, " << objectSize << " B objects, " << keepPercent << "% of " << objects << " kept" << std::endl;
+	std::cout << std::fixed << std::setprecision(2) << "  slabs: " << before << " after frees, " << shrunk << " after shrink, " << compacted
+		<< " after compaction (" << blocks << " blocks freed in " << ms << " ms)" << (ok ? "" : ", OBJECTS DAMAGED!") << std::endl;
+	kmem_cache_destroy(cache);
+}
+
+
+void benchmark_zalloc(size_t objectSize, int objects, int rounds) {
+	std::vector<void*> live(objects);
+	double ms[2][2];	// [memset, zalloc][fresh slabs, reused objects]
+	for (int zalloc = 0; zalloc < 2; zalloc++) {
+		kmem_cache_t* cache = kmem_cache_create(zalloc ? "zalloc" : "alloc+memset", objectSize, nullptr, nullptr);
+		for (int reused = 0; reused < 2; reused++) {
+			ms[zalloc][reused] = measure_ms([&]() {
+				for (int r = 0; r < rounds; r++) {
+					for (int i = 0; i < objects; i++) {
+						if (zalloc) live[i] = kmem_cache_zalloc(cache);
+						else {
+							live[i] = kmem_cache_alloc(cache);
+							memset(live[i], 0, objectSize);
+						}
+						*(char*)live[i] = 1;	// The object is used, so it is not zero when it is freed.
+					}
+					for (int i = 0; i < objects; i++) kmem_cache_free(cache, live[i]);
+					if (!reused) kmem_cache_shrink(cache);	// The next round gets fresh slabs.
+				}
+			});
+		}
+		kmem_cache_destroy(cache);
+	}
+	std::cout << "zeroed allocation, " << objectSize << " B objects, " << objects << " x " << rounds << " rounds (ms)" << std::endl;
+	std::cout << std::setw(16) << "" << std::setw(14) << "fresh slabs" << std::setw(14) << "reused" << std::endl;
+	std::cout << std::fixed << std::setprecision(2);
+	std::cout << std::setw(16) << "alloc + memset" << std::setw(14) << ms[0][0] << std::setw(14) << ms[0][1] << std::endl;
+	std::cout << std::setw(16) << "zalloc" << std::setw(14) << ms[1][0] << std::setw(14) << ms[1][1] << std::endl;
+}
+
+
+void benchmark_slab_cycles(size_t objectSize, int slabs, int cycles, int threads) {
+	std::vector<std::thread> workers;
+	double ms = measure_ms([&]() {
+		for (int t = 0; t < threads; t++) workers.emplace_back([=]() {
+			kmem_cache_t* cache = kmem_cache_create("cycles", objectSize, nullptr, nullptr);
+			int objects = slabs * Slab::optimalNumOfSlotsPerSlab(objectSize, 1, objectSize >= OFF_SLAB_THRESHOLD);
+			std::vector<void*> live(objects);
+			for (int c = 0; c < cycles; c++) {
+				for (int i = 0; i < objects; i++) live[i] = kmem_cache_alloc(cache);
+				for (int i = 0; i < objects; i++) kmem_cache_free(cache, live[i]);
+				kmem_cache_shrink(cache);
+				kmem_cache_shrink(cache);	// (the first one is avoided right after the cache has grown)
+			}
+			kmem_cache_destroy(cache);
+		});
+		for (std::thread& w : workers) w.join();
+	});
+	std::cout << "slab cycles, " << objectSize << " B objects, " << slabs << " slabs x " << cycles << " cycles, " << threads << " threads" << std::endl;
+	std::cout << std::fixed << std::setprecision(2) << "  time: " << ms << " ms, "
+		<< ms * 1e6 / ((double)cycles * slabs * threads) << " ns per slab created and destroyed" << std::endl;
+}
+
+
+void benchmark_contended(size_t objectSize, int opsPerThread, int maxThreads) {
+	kmem_cache_t* cache = kmem_cache_create("contended", objectSize, nullptr, nullptr);
+	std::cout << "contended throughput, " << objectSize << " B objects, " << opsPerThread << " alloc/free pairs per thread (Mops/s)" << std::endl;
+	std::cout << std::setw(10) << "threads" << std::setw(12) << "cache" << std::setw(12) << "kmalloc" << std::endl;
+	for (int threads = 1; threads <= maxThreads; threads *= 2) {
+		double mops[2];
+		for (int useKmalloc = 0; useKmalloc < 2; useKmalloc++) {
+			std::vector<std::thread> workers;
+			double ms = measure_ms([&]() {
+				for (int t = 0; t < threads; t++) workers.emplace_back([&]() {
+					void* held[16] = { nullptr };	// A few objects stay allocated, so slabs are not always emptied.
+					for (int i = 0; i < opsPerThread; i++) {
+						int k = i & 15;
+						if (held[k] != nullptr) {
+							if (useKmalloc) kfree(held[k]);
+							else kmem_cache_free(cache, held[k]);
+						}
+						held[k] = useKmalloc ? kmalloc(objectSize) : kmem_cache_alloc(cache);
+					}
+					for (void* p : held) {
+						if (useKmalloc) kfree(p);
+						else kmem_cache_free(cache, p);
+					}
+				});
+				for (std::thread& w : workers) w.join();
+			});
+			mops[useKmalloc] = (double)threads * opsPerThread / ms / 1000;
+		}
+		std::cout << std::fixed << std::setprecision(2) << std::setw(10) << threads << std::setw(12) << mops[0] << std::setw(12) << mops[1] << std::endl;
+	}
+	kmem_cache_destroy(cache);
+}
+
+
+void benchmark_coloring(size_t objectSize, int maxSlabs, int rounds) {
+	const cache_geometry& g = Allocator::cache_geometry_info();
+	std::cout << "coloring, " << objectSize << " B objects, the first one of each slab is hot; L1 " << g.l1_size / 1024 << " KB " << g.l1_ways << "-way, L2 "
+		<< g.l2_size / 1024 << " KB " << g.l2_ways << "-way, " << g.line_size << " B lines (ns per access)" << std::endl;
+	std::cout << std::setw(10) << "slabs" << std::setw(12) << "no color" << std::setw(12) << "colored" << std::endl;
+	for (int slabs = 8; slabs <= maxSlabs; slabs *= 2) {
+		double ns[2];
+		for (int colored = 0; colored < 2; colored++) {
+			kmem_cache_t* cache = kmem_cache_create_aligned(colored ? "colored" : "not colored", objectSize, 8, colored ? SLAB_NO_MERGE : SLAB_NO_COLOR, nullptr, nullptr);
+			std::vector<void*> all;
+			std::vector<long*> hot;
+			Slab* last = nullptr;
+			while ((int)hot.size() < slabs) {
+				void* p = kmem_cache_alloc(cache);
+				if (p == nullptr) break;	// (not enough space)
+				all.push_back(p);
+				if (Allocator::slab_of(p) != last) hot.push_back((long*)p);	// Fresh slabs hand out their first slot first.
+				last = Allocator::slab_of(p);
+			}
+			for (long* p : hot) *p = 0;
+			int passes = rounds * 65536 / slabs;
+			double ms = measure_ms([&]() {
+				for (int r = 0; r < passes; r++)
+					for (long* p : hot) ++*p;
+			});
+			ns[colored] = ms * 1e6 / ((double)passes * hot.size());
+			for (void* p : all) kmem_cache_free(cache, p);
+			kmem_cache_destroy(cache);
+		}
+		std::cout << std::fixed << std::setprecision(2) << std::setw(10) << slabs << std::setw(12) << ns[0] << std::setw(12) << ns[1] << std::endl;
+	}
+}
+
+
+void benchmark_slab_geometry() {
+	std::vector<size_t> sizes;
+	for (size_t size = MIN_SIZE_POWER_OF_2_BYTES; size <= MAX_SIZE_BYTES; size *= 2) sizes.push_back(size);
+	for (size_t size : { 100, 1500, 3000, 5000, 6000, 9000, 12000, 20000, 40000 }) sizes.push_back(size);
+	std::sort(sizes.begin(), sizes.end());
+
+	std::cout << "slab geometry: 2^i blocks vs. exact runs (vs. off-slab descriptors from " << OFF_SLAB_THRESHOLD << " B)" << std::endl;
+	std::cout << std::setw(8) << "size" << std::setw(16) << "2^i blk/obj" << std::setw(10) << "waste"
+		<< std::setw(16) << "exact blk/obj" << std::setw(10) << "waste" << std::setw(14) << "saved/MB"
+		<< std::setw(16) << "off-slab" << std::setw(10) << "waste" << std::endl;
+	std::cout << std::fixed << std::setprecision(1);
+	for (size_t size : sizes) {
+		size_t slotSize = (size + SLAB_OBJECT_ALIGNMENT - 1) / SLAB_OBJECT_ALIGNMENT * SLAB_OBJECT_ALIGNMENT;
+		int slots_old = Slab::optimalNumOfSlotsPerSlab(slotSize, 1, false, true);
+		int blocks_old = Allocator::bytes_required_to_blocks_allocated(Slab::spaceRequired(slots_old, slotSize));
+		int slots_new = Slab::optimalNumOfSlotsPerSlab(slotSize);
+		int blocks_new = Slab::blocksRequired(slots_new, slotSize);
+		double per_obj_old = (double)blocks_old * BLOCK_SIZE / slots_old;
+		double per_obj_new = (double)blocks_new * BLOCK_SIZE / slots_new;
+		// Memory saved for every MB of objects, in KB.
+		double saved = (per_obj_old - per_obj_new) / slotSize * 1024;
+		std::cout << std::setw(8) << size
+			<< std::setw(16) << (std::to_string(blocks_old) + "/" + std::to_string(slots_old))
+			<< std::setw(9) << 100. * (1 - (double)slots_old * slotSize / (blocks_old * BLOCK_SIZE)) << "%"
+			<< std::setw(16) << (std::to_string(blocks_new) + "/" + std::to_string(slots_new))
+			<< std::setw(9) << 100. * (1 - (double)slots_new * slotSize / (blocks_new * BLOCK_SIZE)) << "%"
+			<< std::setw(11) << saved << " KB";
+		if (slotSize >= OFF_SLAB_THRESHOLD) {	// Descriptors in the metadata cache count as waste too.
+			int slots_off = Slab::optimalNumOfSlotsPerSlab(slotSize, 1, true);
+			int blocks_off = Slab::blocksRequired(slots_off, slotSize, 1, true);
+			double total = (double)blocks_off * BLOCK_SIZE + Slab::descriptorSize(slots_off);
+			std::cout << std::setw(16) << (std::to_string(blocks_off) + "/" + std::to_string(slots_off))
+				<< std::setw(9) << 100. * (1 - slots_off * slotSize / total) << "%";
+		}
+		std::cout << std::endl;
+	}
+}
+
+
+
+static long anon_huge_pages_kb() {	// of the whole process, -1 if the kernel does not tell
+	std::ifstream in("/proc/self/smaps_rollup");
+	std::string key;
+	long kb;
+	while (in >> key) {
+		if (key == "AnonHugePages:" && in >> kb) return kb;
+	}
+	return -1;
+}
+
+
+void benchmark_huge_pages(size_t objectSize, int objects, int caches) {
+	std::vector<kmem_cache_t*> cs;
+	for (int c = 0; c < caches; c++) {
+		char name[NAME_LENGTH];
+		snprintf(name, NAME_LENGTH, "huge page %d", c % 100);
+		cs.push_back(kmem_cache_create_aligned(name, objectSize, 8, SLAB_NO_MERGE, nullptr, nullptr));
+	}
+	// Caches that grow side by side: without packing their slabs alternate in the space.
+	std::vector<std::vector<void*>> objs(caches);
+	for (int i = 0; i < objects; i++) {
+		void* p = kmem_cache_alloc(cs[i % caches]);
+		if (p == nullptr) break;	// (not enough space)
+		objs[i % caches].push_back(p);
+	}
+	std::map<uintptr_t, std::set<int>> owners;	// huge page -> caches with objects in it
+	for (int c = 0; c < caches; c++)
+		for (void* p : objs[c]) owners[(uintptr_t)p / HUGE_PAGE_SIZE].insert(c);
+	int shared = 0;
+	for (auto& o : owners) shared += o.second.size() > 1;
+	std::set<uintptr_t> spanned;	// by the objects of one cache
+	for (void* p : objs[0]) spanned.insert((uintptr_t)p / HUGE_PAGE_SIZE);
+
+	// Random pointer chase over the objects of one cache: a TLB miss per access unless its pages are few and huge.
+	std::vector<void*> order = objs[0];
+	std::shuffle(order.begin(), order.end(), std::mt19937(12345));
+	for (size_t i = 0; i < order.size(); i++) *(void**)order[i] = order[(i + 1) % order.size()];
+	void* p = order.empty() ? nullptr : order[0];
+	long steps = 1L << 24;
+	double ms = measure_ms([&]() {
+		for (long i = 0; i < steps && p != nullptr; i++) p = *(void**)p;
+	});
+	if (p == nullptr) steps = 0;
+
+	std::cout << "huge pages, " << caches << " caches of " << objectSize << " B objects growing together (" << objects << " objects)" << std::endl;
+	std::cout << std::fixed << std::setprecision(2) << "  " << owners.size() << " huge pages, " << shared << " shared by caches, one cache spans "
+		<< spanned.size() << "; chase " << (steps ? ms * 1e6 / steps : 0.) << " ns per access; AnonHugePages " << anon_huge_pages_kb() << " kB" << std::endl;
+	for (int c = 0; c < caches; c++) {
+		for (void* q : objs[c]) kmem_cache_free(cs[c], q);
+		kmem_cache_destroy(cs[c]);
+	}
+}
+
+
+
+static size_t expensive_size;
+
+static void expensive_ctor(void* p) {	// a few microseconds, e.g. a table filled in by a computation
+	unsigned x = (unsigned)(uintptr_t)p;
+	unsigned* words = (unsigned*)p;
+	for (int r = 0; r < 32; r++)
+		for (size_t i = 0; i < expensive_size / sizeof(unsigned); i++) words[i] = x = x * 1103515245u + 12345u;
+}
+
+
+void benchmark_async_construction(size_t objectSize, int objects, int idleMs) {
+	expensive_size = objectSize;
+	std::cout << "async construction, " << objectSize << " B objects with an expensive constructor, " << objects << " allocated (ms)" << std::endl;
+	const char* names[3] = { "constructed on allocation", "SLAB_ASYNC_CTOR", "SLAB_ASYNC_CTOR, prefilled" };
+	for (int mode = 0; mode < 3; mode++) {
+		kmem_cache_t* cache = kmem_cache_create_aligned(names[mode], objectSize, 8, mode ? SLAB_ASYNC_CTOR : 0, expensive_ctor, nullptr);
+		if (mode == 2) {	// Warmed up before the traffic, while the process is idle.
+			kmem_cache_prefill(cache, objects);
+			std::this_thread::sleep_for(std::chrono::milliseconds(idleMs));
+		}
+		std::vector<void*> objs(objects);
+		double ms = measure_ms([&]() {
+			for (int i = 0; i < objects; i++) objs[i] = kmem_cache_alloc(cache);
+		});
+		bool ok = true;
+		for (void* p : objs) ok = ok && p != nullptr;
+		std::cout << std::fixed << std::setprecision(2) << std::setw(30) << names[mode] << std::setw(10) << ms << (ok ? "" : " (OUT OF MEMORY)") << std::endl;
+		for (void* p : objs)
+			if (p != nullptr) kmem_cache_free(cache, p);
+		kmem_cache_destroy(cache);
+	}
+}
+
+
+
+#define STRESS_LIVE (64)	// objects a stress thread holds at most
+#define STRESS_TOLERANCE (0.2)	// scaling may fall this much below the baseline
+#define STRESS_PATTERN (0x5A5A5A5A5A5A5A5AUL)	// written by the constructor of a shared cache after the stamp
+
+struct StressObject {
+	kmem_cache_t* cache;	// nullptr for kmalloc
+	unsigned long* p;
+	unsigned long stamp;	// kept in the first word: another thread that got the same object overwrites it
+};
+
+static void stress_ctor(void* p) {
+	((unsigned long*)p)[1] = STRESS_PATTERN;
+}
+
+static int stress_thread(int id, int ops, const std::vector<kmem_cache_t*>& shared) {
+	std::mt19937 rng(id * 7919 + 1);
+	std::vector<StressObject> live;
+	unsigned long seq = 0;
+	int errors = 0;
+	auto release = [&](const StressObject& o) {
+		if (*o.p != o.stamp) errors++;	// double allocation
+		if (o.cache != nullptr) kmem_cache_free(o.cache, o.p);
+		else kfree(o.p);
+	};
+	for (int op = 0; op < ops; op++) {
+		unsigned r = rng() % 100;
+		if (r < 48 && live.size() < STRESS_LIVE) {
+			StressObject o;
+			size_t k = rng() % (shared.size() + 1);
+			o.cache = k < shared.size() ? shared[k] : nullptr;
+			o.p = (unsigned long*)(o.cache != nullptr ? kmem_cache_alloc(o.cache) : kmalloc(16 + rng() % 2032));
+			if (o.p == nullptr) continue;	// (the space may be small)
+			if (k == 1 && o.p[1] != STRESS_PATTERN) errors++;	// not constructed
+			o.stamp = ((unsigned long)id << 40) | ++seq;
+			*o.p = o.stamp;
+			live.push_back(o);
+		}
+		else if (r < 96 && !live.empty()) {
+			size_t i = rng() % live.size();
+			release(live[i]);
+			live[i] = live.back();
+			live.pop_back();
+		}
+		else if (r < 98) kmem_cache_shrink(shared[rng() % shared.size()]);
+		else {	// A short-lived cache of the thread's own.
+			char name[NAME_LENGTH];
+			snprintf(name, NAME_LENGTH, "stress %d", id % 1000);
+			kmem_cache_t* c = kmem_cache_create(name, 32 + 8 * (rng() % 60), nullptr, nullptr);	// (stamps need 8 B alignment)
+			if (c == nullptr) continue;
+			std::vector<StressObject> own;
+			for (int i = 0; i < 16; i++) {
+				StressObject o = { c, (unsigned long*)kmem_cache_alloc(c), ((unsigned long)id << 40) | ++seq };
+				if (o.p == nullptr) break;
+				*o.p = o.stamp;
+				own.push_back(o);
+			}
+			for (const StressObject& o : own) release(o);
+			if (c->check() != 0) errors++;
+			kmem_cache_destroy(c);
+		}
+	}
+	for (const StressObject& o : live) release(o);
+	return errors;
+}
+
+
+int benchmark_stress(int maxThreads, int opsPerThread, const char* resultsFile, const char* baselineFile) {
+	std::vector<kmem_cache_t*> shared;
+	shared.push_back(kmem_cache_create("stress small", 24, nullptr, nullptr));
+	shared.push_back(kmem_cache_create_aligned("stress built", 200, 8, SLAB_ASYNC_CTOR, stress_ctor, nullptr));
+	shared.push_back(kmem_cache_create_aligned("stress aligned", 1000, 64, SLAB_HWCACHE_ALIGN, nullptr, nullptr));
+	std::vector<int> counts;
+	for (int t = 1; t < maxThreads; t *= 2) counts.push_back(t);
+	counts.push_back(maxThreads);
+
+	std::cout << "stress: alloc/free/shrink/create/destroy, " << opsPerThread << " ops per thread" << std::endl;
+	std::cout << std::setw(10) << "threads" << std::setw(14) << "ops/s" << std::setw(10) << "scaling" << std::setw(10) << "baseline" << std::endl;
+	std::map<int, double> baseline;	// threads -> scaling
+	std::ifstream in(baselineFile);
+	bool haveBaseline = in.good();
+	std::string line;
+	while (std::getline(in, line)) {
+		int t;
+		double opsPerSec, scaling;
+		if (line.empty() || line[0] == '#' || sscanf(line.c_str(), "%d %lf %lf", &t, &opsPerSec, &scaling) != 3) continue;
+		baseline[t] = scaling;
+	}
+	std::ofstream out(resultsFile);
+	out << "# threads, ops/s, scaling (ops/s per thread relative to 1 thread)" << std::endl;
+	int ret = 0;
+	double single = 0;
+	for (int t : counts) {
+		std::vector<std::thread> threads;
+		std::vector<int> errors(t, 0);
+		double ms = measure_ms([&]() {
+			for (int i = 0; i < t; i++) threads.emplace_back([&, i]() { errors[i] = stress_thread(i + 1, opsPerThread, shared); });
+			for (std::thread& th : threads) th.join();
+		});
+		Allocator::drain_page_cache();	// (those of the threads were drained when they ended)
+		bool ok = true;
+		for (int e : errors) ok = ok && e == 0;
+		for (kmem_cache_t* c : shared) ok = ok && c->check() == 0;
+		ok = ok && Allocator::check_buddy() >= 0;
+		double opsPerSec = (double)t * opsPerThread / ms * 1000;
+		if (t == 1) single = opsPerSec;
+		double scaling = opsPerSec / t / single;
+		out << t << " " << (long)opsPerSec << " " << std::fixed << std::setprecision(3) << scaling << std::endl;
+		std::cout << std::fixed << std::setprecision(2) << std::setw(10) << t << std::setw(14) << (long)opsPerSec << std::setw(10) << scaling;
+		if (baseline.count(t)) std::cout << std::setw(10) << baseline[t];
+		if (!ok) {
+			std::cout << "  INVARIANTS BROKEN!";
+			ret = 1;
+		}
+		else if (baseline.count(t) && scaling < baseline[t] * (1 - STRESS_TOLERANCE)) {
+			std::cout << "  BELOW BASELINE!";
+			if (ret == 0) ret = 2;
+		}
+		std::cout << std::endl;
+	}
+	out.close();
+	if (!haveBaseline && ret == 0) {	// The first run on a machine stores its baseline.
+		std::ifstream results(resultsFile);
+		std::ofstream(baselineFile) << results.rdbuf();
+		std::cout << "  (stored as the baseline in " << baselineFile << ")" << std::endl;
+	}
+	for (kmem_cache_t* c : shared) kmem_cache_destroy(c);
+	return ret;
+}
+
+
+
+void benchmark_tuning(size_t objectSize, int objectsPerThread, int threads, int rounds) {
+	kmem_cache_t* cache = kmem_cache_create("tuned", objectSize, nullptr, nullptr);
+	std::cout << "slab size tuning, " << threads << " threads allocate " << objectsPerThread << " objects of " << objectSize
+		<< " B each, then free them (TUNE_WINDOW " << TUNE_WINDOW << ")" << std::endl;
+	std::cout << std::setw(10) << "round" << std::setw(10) << "ms" << std::setw(10) << "slabs" << std::setw(10) << "level" << std::setw(10) << "obj/slab" << std::endl;
+	int maxLevel = 0;
+	for (int r = 0; r < rounds; r++) {
+		std::vector<std::thread> workers;
+		int slabs = 0;
+		double ms = measure_ms([&]() {
+			for (int t = 0; t < threads; t++) workers.emplace_back([&]() {
+				std::vector<void*> objs(objectsPerThread);
+				for (void*& p : objs) p = kmem_cache_alloc(cache);
+				for (void* p : objs)
+					if (p != nullptr) kmem_cache_free(cache, p);
+			});
+			for (std::thread& w : workers) w.join();
+		});
+		slabs = cache->numOfSlabs();
+		if (cache->tuneLevel() > maxLevel) maxLevel = cache->tuneLevel();
+		std::cout << std::fixed << std::setprecision(2) << std::setw(10) << r << std::setw(10) << ms << std::setw(10) << slabs
+			<< std::setw(10) << cache->tuneLevel() << std::setw(10) << cache->slotsPerSlab() << std::endl;
+		kmem_cache_shrink(cache);	// (avoided right after growth)
+		kmem_cache_shrink(cache);	// The next round grows again, so the cache is retuned.
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(TUNE_IDLE_MIN_MS));
+	kmem_cache_shrink(cache);	// The rounds end here for the idle check.
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	kmem_cache_shrink(cache);
+	int idleLevel = cache->tuneLevel();
+	std::cout << "  after 100 ms idle and a shrink: level " << idleLevel << ", " << cache->slotsPerSlab() << " obj/slab" << std::endl;
+	kmem_cache_destroy(cache);
+
+	// Without a second core the lock is hardly ever found held, so the level has no reason to rise.
+	// Timing decides both, so they are reported only (test_tuning checks the mechanism).
+	bool contended = threads > 1 && std::thread::hardware_concurrency() > 1;
+	if (contended && maxLevel <= 1) std::cout << "  level never rose under load" << std::endl;
+	else std::cout << "  highest level " << maxLevel << (contended ? "" : " (one core: no contention expected)") << std::endl;
+	if (TUNE_WINDOW > 0 && idleLevel != 0) std::cout << "  level kept while idle" << std::endl;
+}
+
+
+void benchmark_metrics(size_t objectSize, int opsPerThread, int maxThreads, const char* path) {
+	kmem_cache_t* cache = kmem_cache_create("metrics", objectSize, nullptr, nullptr);
+	std::cout << "metrics, " << opsPerThread << " counts per thread: one shared atomic vs. per-thread counters (ns per count)" << std::endl;
+	std::cout << std::setw(10) << "threads" << std::setw(12) << "shared" << std::setw(12) << "per-thread" << std::endl;
+	int slot = Metrics::acquireSlot();
+	for (int threads = 1; threads <= maxThreads; threads *= 2) {
+		double ns[2];
+		for (int perThread = 0; perThread < 2; perThread++) {
+			alignas(CACHE_L1_LINE_SIZE) std::atomic<long long> shared(0);
+			std::vector<std::thread> workers;
+			double ms = measure_ms([&]() {
+				for (int t = 0; t < threads; t++) workers.emplace_back([&]() {
+					for (int i = 0; i < opsPerThread; i++) {
+						if (perThread) Metrics::count(slot, METRIC_ALLOCS);
+						else shared.fetch_add(1, std::memory_order_relaxed);
+					}
+				});
+				for (std::thread& w : workers) w.join();
+			});
+			ns[perThread] = ms * 1e6 / ((double)threads * opsPerThread);
+		}
+		std::cout << std::fixed << std::setprecision(2) << std::setw(10) << threads << std::setw(12) << ns[0] << std::setw(12) << ns[1] << std::endl;
+	}
+	Metrics::releaseSlot(slot);
+
+	// Counts of several threads are merged on export.
+	std::vector<std::thread> workers;
+	for (int t = 0; t < maxThreads; t++) workers.emplace_back([&]() {
+		for (int i = 0; i < opsPerThread / 100; i++) kmem_cache_free(cache, kmem_cache_alloc(cache));
+		kmem_cache_alloc(cache);	// (left in use)
+	});
+	for (std::thread& w : workers) w.join();
+	double ms = measure_ms([&]() { kmem_metrics_write(path); });
+	std::ifstream in(path);
+	std::string line, expected = "kmem_cache_allocs_total{cache=\"metrics\"} " + std::to_string((long long)maxThreads * (opsPerThread / 100 + 1));
+	bool found = false, objects = false;
+	size_t bytes = 0;
+	while (std::getline(in, line)) {
+		bytes += line.size() + 1;
+		found = found || line == expected;
+		objects = objects || line == "kmem_cache_objects{cache=\"metrics\"} " + std::to_string(maxThreads);
+	}
+	std::cout << "  export to " << path << ": " << bytes << " B in " << std::setprecision(3) << ms << " ms, counts "
+		<< (found && objects ? "match" : "DO NOT MATCH") << std::endl;
+	kmem_cache_destroy(cache);
+}
+
+
+void benchmark_buddy_churn(size_t objectSize, int slabs, int cycles) {
+	int slots = Slab::optimalNumOfSlotsPerSlab(objectSize, 1, objectSize >= OFF_SLAB_THRESHOLD);
+	size_t largeSize = 2 * MAX_SIZE_BYTES;
+	std::cout << "buddy churn, " << slabs << " slabs of " << Slab::blocksRequired(slots, objectSize, 1, objectSize >= OFF_SLAB_THRESHOLD) << " blocks ("
+		<< objectSize << " B objects) or " << slabs << " large buffers of " << largeSize / 1024 << " KB, created and destroyed " << cycles << " times (per slab or buffer)" << std::endl;
+	std::cout << std::setw(12) << "lazy chunks" << std::setw(12) << "slab ns" << std::setw(10) << "splits" << std::setw(10) << "merges"
+		<< std::setw(12) << "large ns" << std::setw(10) << "splits" << std::setw(10) << "merges" << std::endl;
+	Allocator::set_page_cache(false);	// Every run freed goes to the buddy lists, descriptors and small slabs too.
+	for (int lazy : { 0, BUDDY_LAZY_CHUNKS }) {
+		Allocator::set_lazy_chunks(lazy);
+		kmem_cache_t* cache = kmem_cache_create("buddy churn", objectSize, nullptr, nullptr);
+		std::vector<void*> live((size_t)slabs * slots);
+		std::vector<void*> large(slabs);
+		double n = (double)cycles * slabs;
+		std::cout << std::fixed << std::setprecision(2) << std::setw(12) << lazy;
+		for (int useLarge = 0; useLarge < 2; useLarge++) {
+			long long splits0, merges0, splits1, merges1;
+			Allocator::buddy_counts(&splits0, &merges0);
+			double ms = measure_ms([&]() {
+				for (int c = 0; c < cycles; c++) {
+					if (useLarge) {
+						for (void*& p : large) p = kmalloc(largeSize);
+						for (void* p : large) kfree(p);
+						continue;
+					}
+					for (void*& p : live) p = kmem_cache_alloc(cache);
+					for (void* p : live) kmem_cache_free(cache, p);
+					kmem_cache_shrink(cache);
+					kmem_cache_shrink(cache);	// (the first one is avoided right after the cache has grown)
+				}
+			});
+			Allocator::buddy_counts(&splits1, &merges1);
+			std::cout << std::setw(12) << ms * 1e6 / n << std::setw(10) << (splits1 - splits0) / n << std::setw(10) << (merges1 - merges0) / n;
+		}
+		std::cout << std::endl;
+		kmem_cache_destroy(cache);
+	}
+	Allocator::set_lazy_chunks(BUDDY_LAZY_CHUNKS);
+	Allocator::set_page_cache(true);
+	if (Allocator::check_buddy() < 0) std::cout << "  BUDDY LISTS BROKEN!" << std::endl;
+}
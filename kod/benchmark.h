@@ -0,0 +1,25 @@
+#pragma once
+
+// Benchmarks expect kmem_init() to have been called with enough space.
+
+void benchmark_pmr_containers(int elements, int rounds);	// std::pmr containers: default resource vs. kmem_resource()
+void benchmark_churn(size_t objectSize, int liveObjects, int phases);	// grow, free at random, replace at random: peak and steady-state slabs
+void benchmark_alloc_order(size_t objectSize, int objects, int rounds);	// allocate and write, free in random order: ns per allocation
+void benchmark_lifetimes(size_t size, int objects, int longLivedEvery);	// short-lived buffers freed around long-lived ones: slabs left, with and without kmalloc_hint
+void benchmark_realloc(size_t maxSize, int growthPercent, int rounds);	// buffers grown step by step: krealloc vs. kmalloc + memcpy + kfree
+void benchmark_compaction(size_t objectSize, int objects, int keepPercent);	// random frees, then shrink vs. compaction of a movable cache
+void benchmark_zalloc(size_t objectSize, int objects, int rounds);	// kmem_cache_alloc + memset vs. kmem_cache_zalloc
+void benchmark_slab_cycles(size_t objectSize, int slabs, int cycles, int threads);	// caches that grow by some slabs and shrink again
+void benchmark_buddy_churn(size_t objectSize, int slabs, int cycles);	// slabs too large for the page cache and large buffers, created and destroyed: joining every freed chunk vs. lazy buddies
+void benchmark_contended(size_t objectSize, int opsPerThread, int maxThreads);	// threads allocating from one cache and kmalloc: Mops/s
+void benchmark_coloring(size_t objectSize, int maxSlabs, int rounds);	// first objects of slabs touched over and over: SLAB_NO_COLOR vs. coloring
+void benchmark_slab_geometry();	// blocks per object of size classes: 2^i block slabs vs. exact block runs vs. off-slab descriptors
+void benchmark_huge_pages(size_t objectSize, int objects, int caches);	// caches growing together, objects of one chased at random: huge pages shared and ns per access (see kmem_init_arena)
+void benchmark_async_construction(size_t objectSize, int objects, int idleMs);	// expensive constructor: on allocation vs. SLAB_ASYNC_CTOR vs. kmem_cache_prefill and idle time first
+// Stress run over 1, 2, 4... maxThreads threads, then invariants (stamps of live objects, slab lists, buddy lists).
+// ops/s and scaling go to resultsFile; scaling is compared with baselineFile, which is written if it does not exist.
+// Returns 0, 1 if an invariant is broken, 2 if scaling fell more than STRESS_TOLERANCE below the baseline.
+int benchmark_stress(int maxThreads, int opsPerThread, const char* resultsFile, const char* baselineFile);
+
+void benchmark_tuning(size_t objectSize, int objectsPerThread, int threads, int rounds);	// bursts from several threads, then idle: slab size level chosen by the cache
+void benchmark_metrics(size_t objectSize, int opsPerThread, int maxThreads, const char* path);	// counting: shared atomic vs. per-thread counters, then an export checked against the counts
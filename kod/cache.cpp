@@ -1,292 +1,718 @@
-#include "cache.h"
-#include "allocator.h"
-#include "slab.h"
-#include "slab class.h"
-#include <new>
-#include <string>
-#include <iomanip>
-
-
-
-Cache* Cache::headCache = nullptr;
-
-
-Cache* Cache::createCacheForCaches() {
-	void* loc = Allocator::buddy_alloc_space_required(sizeof(Cache));
-	if (loc == nullptr) return nullptr;	// error
-	Cache* c = new (loc) Cache("CACHE FOR CACHES", sizeof(Cache), nullptr, nullptr);	// Placement new!
-	return c;
-}
-
-
-Cache* Cache::createCache(const char* name, size_t size, void(*ctor)(void *), void(*dtor)(void *)) {
-	void* loc = Allocator::allocateMemoryForCacheCreation();
-	if (loc == nullptr) return nullptr;	// error
-	Cache* c = new (loc) Cache(name, size, ctor, dtor);	// Placement new!
-	return c;
-}
-
-
-Cache::Cache(const char* name, size_t size, void(*ctor)(void *), void(*dtor)(void *)) {
-	snprintf(this->name, NAME_LENGTH, "%s", name);
-	slotSize = size;
-	optimalNumOfSlotsPerSlab = Slab::optimalNumOfSlotsPerSlab(size);
-	constructor = ctor;
-	destructor = dtor;
-
-	nextCache = headCache;
-	headCache = this;
-
-	slabsFullHead = nullptr;
-	slabsPartialHead = nullptr;
-	slabsFreeHead = nullptr;
-	numOfSlabs = 0;
-
-	slabAllocatedSinceLastShrink = false;
-	shrinkDone = false;
-
-	alignments = Slab::unusedSpaceWithOptimalSlots(size) / CACHE_L1_LINE_SIZE;
-	current_alignment = 0;
-
-	error_code = 0;
-}
-
-
-void* Cache::alloc() {
-	m.lock();
-
-	void* ret;
-
-	if (slabsPartialHead != nullptr) {
-		Slab* s = slabsPartialHead;
-		ret = s->alloc(constructor);
-		if (s->isFull()) {
-			slabsPartialHead = slabsPartialHead->getNext();
-			s->setNext(slabsFullHead);
-			slabsFullHead = s;
-		}
-		m.unlock();
-		return ret;
-	}
-
-	if (slabsFreeHead != nullptr) {
-		Slab* s = slabsFreeHead;
-		ret = s->alloc(constructor);
-		if (s->isFull()) {	// in case there is only one object per slab
-			slabsFreeHead = slabsFreeHead->getNext();
-			s->setNext(slabsFullHead);
-			slabsFullHead = s;
-		}
-		else {
-			slabsFreeHead = slabsFreeHead->getNext();
-			s->setNext(slabsPartialHead);
-			slabsPartialHead = s;
-		}
-		m.unlock();
-		return ret;
-	}
-
-	Slab* s = Slab::createSlab(optimalNumOfSlotsPerSlab, slotSize, constructor, current_alignment);
-	if (!s) {
-		error_code = ERROR_NO_MEMORY;
-		m.unlock();
-		return nullptr;
-	}
-	/*
-	// IF VALUES EXCEPT OPTIMAL ARE ALLOWED, SLABS MUST FIX OFFSET IN CASES OF INADEQUATE VALUES
-	if (!s) {	// error, attempt to allocate less memory
-		s = Slab::createSlab(Slab::minimalNumOfSlotsPerSlab(slotSize), slotSize, constructor, current_alignment);
-		if (!s) {	// error, no memory
-			error_code = ERROR_NO_MEMORY;
-			m.unlock();
-			return nullptr;
-		}
-	}*/
-
-	ret = s->alloc(constructor);
-	numOfSlabs++;
-	if (alignments != 0) current_alignment = (current_alignment + 1) % alignments;
-	if (s->isFull()) {	// in case there is only one object per slab
-		s->setNext(slabsFullHead);
-		slabsFullHead = s;
-	}
-	else {
-		s->setNext(slabsPartialHead);
-		slabsPartialHead = s;
-	}
-	if (shrinkDone == true) {
-		slabAllocatedSinceLastShrink = true;
-		shrinkDone = false;
-	}
-	else if (slabAllocatedSinceLastShrink == true) {
-		shrinkDone = false;
-		slabAllocatedSinceLastShrink = false;
-	}
-	m.unlock();
-	return ret;
-}
-
-
-bool Cache::free(void* objp) {
-	m.lock();
-
-	for (Slab *s = slabsFullHead, *prev = nullptr; s != nullptr; prev = s, s = s->getNext()) {
-		if (s->free(objp) == true) {
-			if (prev) prev->setNext(s->getNext());
-			else slabsFullHead = slabsFullHead->getNext();
-			if (s->isEmpty()) {
-				s->setNext(slabsFreeHead);
-				slabsFreeHead = s;
-			}
-			else {
-				s->setNext(slabsPartialHead);
-				slabsPartialHead = s;
-			}
-			m.unlock();
-			return true;
-		}
-	}
-	for (Slab* s = slabsPartialHead, *prev = nullptr; s != nullptr; prev = s, s = s->getNext()) {
-		if (s->free(objp) == true) {
-			if (s->isEmpty()) {
-				if (prev) prev->setNext(s->getNext());
-				else slabsPartialHead = slabsPartialHead->getNext();
-				s->setNext(slabsFreeHead);
-				slabsFreeHead = s;
-			}
-			m.unlock();
-			return true;
-		}
-	}
-
-	error_code = ERROR_FREEING_OBJECT;
-
-	m.unlock();
-
-	return false;
-}
-
-
-int Cache::destroySlab(Slab* s) {
-	m.lock();
-	s->destroyObjects(destructor);
-	int ret = Allocator::deallocate(s->getSpace(), s->getNumOfBlocks());
-	if (ret != 0) error_code = ERROR_DELETING_SLAB;
-	m.unlock();
-	return ret;
-}
-
-
-void Cache::destroy() {
-//	if (m.try_lock() == false) return;	// Means that another thread is currently destroying this Cache.
-	m.lock();
-
-	Slab* cur = slabsFreeHead;
-	while (cur != nullptr) {
-		slabsFreeHead = slabsFreeHead->getNext();
-		destroySlab(cur);
-		cur = slabsFreeHead;
-	}
-	cur = slabsPartialHead;
-	while (cur != nullptr) {
-		slabsPartialHead = slabsPartialHead->getNext();
-		destroySlab(cur);
-		cur = slabsPartialHead;
-	}
-	cur = slabsFullHead;
-	while (cur != nullptr) {
-		slabsFullHead = slabsFullHead->getNext();
-		destroySlab(cur);
-		cur = slabsFullHead;
-	}
-
-	for (Cache *cur = headCache, *prev = nullptr; cur != nullptr; cur = cur->nextCache) {
-		if (cur == this) {
-			if (prev) prev->nextCache = cur->nextCache;
-			else headCache = cur->nextCache;
-		}
-		prev = cur;
-	}
-
-	m.unlock();
-}
-
-
-int Cache::shrink() {
-	m.lock();
-
-	if (slabAllocatedSinceLastShrink) { // If slab allocation has occured since last shrinking, then return. 0 or some other value?
-		error_code = SHRINKING_AVOIDED;
-		m.unlock();
-		return 0; 
-	}
-	Slab* cur = slabsFreeHead;
-	if (!cur) {
-		m.unlock();
-		return 0;
-	}
-	int blocks_freed = 0;
-	while (cur != nullptr) {
-		slabsFreeHead = cur->getNext();
-		int blocks_cur = cur->getNumOfBlocks();
-		if (destroySlab(cur) == 0) blocks_freed += blocks_cur;	// Should always happen.
-		numOfSlabs--;
-		cur = slabsFreeHead;
-	}
-	shrinkDone = true;
-
-	m.unlock();
-	return blocks_freed;
-}
-
-
-void Cache::info() {
-	m.lock();
-	std::string s = "";
-	s += name; s += '\n';
-	s += std::to_string(slotSize); s += " B/obj\n";
-	s += std::to_string(numOfSlabs * Slab::blocksOccupied(slotSize)); s += " blocks\n";
-	s += std::to_string(numOfSlabs); s += " slabs\n";
-	s += std::to_string(optimalNumOfSlotsPerSlab); s += " obj/slab\n";
-	int slots_occupied = 0;
-	int total_slots = 0;
-	for (Slab* s = slabsFullHead; s != nullptr; s = s->getNext()) {
-		slots_occupied += s->getSlotsOccupied();
-		total_slots += s->getNumOfSlots();
-	}
-	for (Slab* s = slabsPartialHead; s != nullptr; s = s->getNext()) {
-		slots_occupied += s->getSlotsOccupied();
-		total_slots += s->getNumOfSlots();
-	}
-	for (Slab* s = slabsFreeHead; s != nullptr; s = s->getNext())
-		total_slots += s->getNumOfSlots();
-	if (total_slots != 0) {
-		s += std::to_string((float)slots_occupied / (numOfSlabs * optimalNumOfSlotsPerSlab) * 100);
-		s += "% full\n";
-	}
-	else
-		s += "cache has no slots\n";
-	std::cout << s << std::endl;
-	m.unlock();
-}
-
-
-
-
-
-
-kmem_cache_s::kmem_cache_s(Cache* cache) : c(cache) {}
-
-
-int kmem_cache_s::error() const {
-	int ec = c->getErrorCode();
-	switch (ec) {
-	case 0: std::cout << "NO ERROR." << std::endl; break;
-	case ERROR_NO_MEMORY: std::cout << "NO MEMORY AVAILABLE!" << std::endl; break;
-	case ERROR_FREEING_OBJECT: std::cout << "ERROR FREEING OBJECT!" << std::endl; break;
-	case ERROR_DELETING_SLAB: std::cout << "ERROR DELETING SLAB!" << std::endl; break;
-	case SHRINKING_AVOIDED: std::cout << "SHRINKING AVOIDED!" << std::endl; break;
-	default: std::cout << "UNDEFINED ERROR!" << std::endl; break;
-	}
-	return ec;
+#include "cache.h"
+#include "allocator.h"
+#include "slab.h"
+#include "slab class.h"
+#include "construction pool.h"
+#include <new>
+#include <string>
+#include <iomanip>
+#include <cstring>
+#include <chrono>
+
+
+
+std::atomic<Cache*> Cache::headCache(nullptr);
+
+
+static std::atomic<int> threads_colored(0);
+static thread_local int thread_color_plus_one = 0;	// POD, no TLS destructor (see Allocator's page cache)
+
+static int thread_color() {
+	if (thread_color_plus_one == 0) thread_color_plus_one = threads_colored.fetch_add(1, std::memory_order_relaxed) + 1;
+	return thread_color_plus_one - 1;
+}
+
+
+static long long now_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+Cache* Cache::createCacheForCaches() {
+	void* loc = Allocator::buddy_alloc_space_required(sizeof(Cache));
+	if (loc == nullptr) return nullptr;	// error
+	Cache* c = new (loc) Cache("CACHE FOR CACHES", sizeof(Cache), alignof(Cache), nullptr, nullptr);	// Placement new! (Caches keep their locks on separate lines.)
+	c->link();
+	return c;
+}
+
+
+Cache* Cache::createMetaCache(const char* name, int numOfSlots) {
+	void* loc = Allocator::allocateMemoryForCacheCreation();
+	if (loc == nullptr) return nullptr;	// error
+	char meta_name[NAME_LENGTH];
+	snprintf(meta_name, NAME_LENGTH, "%s-meta", name);
+	Cache* c = new (loc) Cache(meta_name, Slab::descriptorSize(numOfSlots), 1, nullptr, nullptr, false);	// Placement new!
+	return c;
+}
+
+
+Cache* Cache::createCache(const char* name, size_t size, void(*ctor)(void *), void(*dtor)(void *), size_t align, unsigned flags) {
+	if (align == 0 || (align & (align - 1)) != 0 || align > BLOCK_SIZE) return nullptr;	// Error: unsupported alignment.
+	void* loc = Allocator::allocateMemoryForCacheCreation();
+	if (loc == nullptr) return nullptr;	// error
+	Cache* c = new (loc) Cache(name, size, align, ctor, dtor);	// Placement new!
+	c->colorFlags = flags & (SLAB_COLOR_PER_THREAD | SLAB_NO_COLOR);
+	c->asyncConstruction = (flags & SLAB_ASYNC_CTOR) && ctor != nullptr;
+	c->link();
+	return c;
+}
+
+
+Cache::Cache(const char* name, size_t size, size_t align, void(*ctor)(void *), void(*dtor)(void *), bool offSlabAllowed) {
+	snprintf(this->name, NAME_LENGTH, "%s", name);
+	alignment = align;
+	slotSize = (size + align - 1) / align * align;
+	metaCache = nullptr;
+	zeroFreshSlabs = false;
+	asyncConstruction = false;
+	if (offSlabAllowed && slotSize >= OFF_SLAB_THRESHOLD) {
+		// Large objects: descriptors go to a metadata cache, objects start at block boundaries.
+		optimalNumOfSlotsPerSlab = Slab::optimalNumOfSlotsPerSlab(slotSize, alignment, true);
+		metaCache = createMetaCache(name, optimalNumOfSlotsPerSlab);
+	}
+	if (metaCache == nullptr) optimalNumOfSlotsPerSlab = Slab::optimalNumOfSlotsPerSlab(slotSize, alignment);	// (also if there is no memory for the metadata cache)
+	tuneLevel = 1;
+	slotsPerSlab = optimalNumOfSlotsPerSlab;
+	lockedOps = 0;
+	contendedOps = 0;
+	grownSinceTune = 0;
+	lastTuneNs = now_ns();
+	idleOps = 0;
+	idleCheckNs = lastTuneNs;
+	opsPerMs = 0;
+	contendedPercent = 0;
+	constructor = ctor;
+	destructor = dtor;
+
+	slabsFullHead = nullptr;
+	for (int i = 0; i < PARTIAL_BUCKETS; i++) slabsPartial[i] = nullptr;
+	partialMask = 0;
+	slabsFreeHead = nullptr;
+	numOfSlabs = 0;
+	peakNumOfSlabs = 0;
+	numOfBlocks = 0;
+	metricsSlot = -1;
+
+	slabAllocatedSinceLastShrink = false;
+	shrinkDone = false;
+
+	colorSize = alignment > Allocator::line_size() ? (int)alignment : (int)Allocator::line_size();	// colors keep objects aligned
+	alignments = Slab::unusedSpaceWithOptimalSlots(slotSize, alignment, isOffSlab()) / colorSize;
+	colorFlags = 0;
+	// Slabs in neighbouring page colors start at neighbouring colors, so consecutive slabs still rotate through the L1 sets.
+	for (int i = 0; i < MAX_PAGE_COLORS; i++) colorOfPage[i] = alignments != 0 ? i % alignments : 0;
+	hugePage = -1;
+
+	error_code = 0;
+
+	relocator = nullptr;
+
+	nextCache = nullptr;
+	handles = nullptr;
+	numOfHandles = 0;
+	mergeable = false;
+}
+
+
+void Cache::link() {
+	metricsSlot = Metrics::acquireSlot();
+	// The cache is fully constructed before it is published.
+	nextCache.store(headCache.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	headCache.store(this, std::memory_order_release);
+}
+
+
+void Cache::unlink() {
+	// Readers that are on this cache go on through nextCache, which stays as it is.
+	Metrics::releaseSlot(metricsSlot);	// (nothing is allocated from the cache any more)
+	Cache* next = nextCache.load(std::memory_order_relaxed);
+	if (headCache.load(std::memory_order_relaxed) == this) {
+		headCache.store(next, std::memory_order_release);
+		return;
+	}
+	for (Cache* cur = headCache.load(std::memory_order_relaxed); cur != nullptr; cur = cur->nextCache.load(std::memory_order_relaxed)) {
+		if (cur->nextCache.load(std::memory_order_relaxed) == this) {
+			cur->nextCache.store(next, std::memory_order_release);
+			return;
+		}
+	}
+}
+
+
+void Cache::addHandle(kmem_cache_s* h) {
+	h->nextHandle.store(handles.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	handles.store(h, std::memory_order_release);
+	++numOfHandles;
+}
+
+
+int Cache::removeHandle(kmem_cache_s* h) {
+	kmem_cache_s* next = h->nextHandle.load(std::memory_order_relaxed);
+	if (handles.load(std::memory_order_relaxed) == h) handles.store(next, std::memory_order_release);
+	else {
+		for (kmem_cache_s* cur = handles.load(std::memory_order_relaxed); cur != nullptr; cur = cur->nextHandle.load(std::memory_order_relaxed)) {
+			if (cur->nextHandle.load(std::memory_order_relaxed) == h) {
+				cur->nextHandle.store(next, std::memory_order_release);
+				break;
+			}
+		}
+	}
+	return --numOfHandles;
+}
+
+
+int Cache::nextColor(const void* slabSpace) {
+	if (alignments == 0 || (colorFlags & SLAB_NO_COLOR)) return 0;
+	std::lock_guard<AdaptiveMutex> guard(m);
+	// Colors are counted per page color: slabs that share L2 sets (same page color) get different
+	// offsets within the page, while slabs in other page colors are apart in L2 already.
+	int page = Allocator::page_color(slabSpace);
+	int color = colorOfPage[page];
+	colorOfPage[page] = (unsigned short)((color + 1) % alignments);
+	if (colorFlags & SLAB_COLOR_PER_THREAD) color = (color + thread_color()) % alignments;
+	return color * colorSize;
+}
+
+
+void Cache::pushSlab(Slab*& head, Slab* s) {
+	s->setPrev(nullptr);
+	s->setNext(head);
+	if (head) head->setPrev(s);
+	head = s;
+}
+
+
+void Cache::unlinkSlab(Slab*& head, Slab* s) {
+	if (s->getPrev()) s->getPrev()->setNext(s->getNext());
+	else head = s->getNext();
+	if (s->getNext()) s->getNext()->setPrev(s->getPrev());
+	s->setNext(nullptr);
+	s->setPrev(nullptr);
+}
+
+
+int Cache::partialBucket(Slab* s) {
+	return s->getSlotsOccupied() * PARTIAL_BUCKETS / s->getNumOfSlots();
+}
+
+
+void Cache::pushPartial(Slab* s) {
+	int i = partialBucket(s);
+	pushSlab(slabsPartial[i], s);
+	partialMask |= 1u << i;
+}
+
+
+void Cache::unlinkPartial(Slab* s, int bucket) {
+	unlinkSlab(slabsPartial[bucket], s);
+	if (slabsPartial[bucket] == nullptr) partialMask &= ~(1u << bucket);
+}
+
+
+Slab* Cache::fullestPartial() {
+	if (partialMask == 0) return nullptr;
+	int i = PARTIAL_BUCKETS - 1;
+	while ((partialMask & (1u << i)) == 0) i--;
+	return slabsPartial[i];
+}
+
+
+Slab* Cache::emptiestPartial() {
+	if (partialMask == 0) return nullptr;
+	int i = 0;
+	while ((partialMask & (1u << i)) == 0) i++;
+	return slabsPartial[i];
+}
+
+
+void* Cache::allocFromPartial(Slab* s, bool zero) {
+	int bucket = partialBucket(s);
+	void* ret = s->alloc(constructor, zero);
+	if (s->isFull()) {
+		unlinkPartial(s, bucket);
+		pushSlab(slabsFullHead, s);
+	}
+	else if (partialBucket(s) != bucket) {
+		unlinkPartial(s, bucket);
+		pushPartial(s);
+	}
+	return ret;
+}
+
+
+void* Cache::alloc(bool grow, bool zero) {
+	lockCounted();	// (held only briefly: slabs are built without it, see growSlab)
+
+	void* ret;
+
+	// The fullest partial slab is used, so that the emptiest ones get a chance to become free.
+	Slab* s = fullestPartial();
+	if (s != nullptr) {
+		ret = allocFromPartial(s, zero);
+		m.unlock();
+		Metrics::count(metricsSlot, METRIC_ALLOCS);
+		return ret;
+	}
+
+	if (slabsFreeHead != nullptr) {
+		s = slabsFreeHead;
+		ret = s->alloc(constructor, zero);
+		unlinkSlab(slabsFreeHead, s);
+		if (s->isFull()) pushSlab(slabsFullHead, s);	// in case there is only one object per slab
+		else pushPartial(s);
+		if (asyncConstruction && grow && slabsFreeHead == nullptr && (s = growSlab()) != nullptr) pushSlab(slabsFreeHead, s);	// The next one is built meanwhile.
+		m.unlock();
+		Metrics::count(metricsSlot, METRIC_ALLOCS);
+		return ret;
+	}
+
+	if (!grow) {
+		m.unlock();
+		return nullptr;
+	}
+
+	if (zero && constructor == nullptr) zeroFreshSlabs = true;
+	s = growSlab();
+	if (!s) {
+		m.unlock();
+		Metrics::count(metricsSlot, METRIC_FAILURES);
+		return nullptr;
+	}
+	/*
+	// IF VALUES EXCEPT OPTIMAL ARE ALLOWED, SLABS MUST FIX OFFSET IN CASES OF INADEQUATE VALUES
+	if (!s) {	// error, attempt to allocate less memory
+		s = Slab::createSlab(this, Slab::minimalNumOfSlotsPerSlab(slotSize, alignment), slotSize, alignment, constructor);
+		if (!s) {	// error, no memory
+			error_code = ERROR_NO_MEMORY;
+			m.unlock();
+			return nullptr;
+		}
+	}*/
+
+	ret = s->alloc(constructor, zero);
+	if (s->isFull()) pushSlab(slabsFullHead, s);	// in case there is only one object per slab
+	else pushPartial(s);
+	if (asyncConstruction && (s = growSlab()) != nullptr) pushSlab(slabsFreeHead, s);	// The next one is built meanwhile.
+	if (shrinkDone == true) {
+		slabAllocatedSinceLastShrink = true;
+		shrinkDone = false;
+	}
+	else if (slabAllocatedSinceLastShrink == true) {
+		shrinkDone = false;
+		slabAllocatedSinceLastShrink = false;
+	}
+	m.unlock();
+	Metrics::count(metricsSlot, METRIC_ALLOCS);
+	return ret;
+}
+
+
+bool Cache::freeObject(void* objp) {
+	// The block map leads straight to the owning slab, so no list has to be searched.
+	Slab* s = Allocator::slab_of(objp);
+
+	if (s == nullptr || s->getOwner() != this) {
+		error_code = ERROR_FREEING_OBJECT;
+		return false;
+	}
+
+	bool wasFull = s->isFull();
+	int bucket = wasFull ? -1 : partialBucket(s);
+	if (s->free(objp) == false) {
+		error_code = ERROR_FREEING_OBJECT;
+		return false;
+	}
+	if (wasFull) {
+		unlinkSlab(slabsFullHead, s);
+		if (s->isEmpty()) pushSlab(slabsFreeHead, s);
+		else pushPartial(s);
+	}
+	else if (s->isEmpty()) {
+		unlinkPartial(s, bucket);
+		pushSlab(slabsFreeHead, s);
+	}
+	else if (partialBucket(s) != bucket) {
+		unlinkPartial(s, bucket);
+		pushPartial(s);
+	}
+	return true;
+}
+
+
+bool Cache::free(void* objp) {
+	lockCounted();
+	bool ret = freeObject(objp);
+	m.unlock();
+	Metrics::count(metricsSlot, ret ? METRIC_FREES : METRIC_FAILURES);
+	return ret;
+}
+
+
+int Cache::freeBulk(void** objs, int n) {
+	int freed = 0;
+	lockCounted();
+	for (int i = 0; i < n; i++)
+		if (freeObject(objs[i])) freed++;
+	m.unlock();
+	Metrics::count(metricsSlot, METRIC_FREES, freed);
+	if (freed < n) Metrics::count(metricsSlot, METRIC_FAILURES, n - freed);
+	return freed;
+}
+
+
+void Cache::lockCounted() {
+	if (!m.try_lock()) {
+		m.lock();
+		contendedOps++;
+	}
+	lockedOps++;
+	idleOps++;
+}
+
+
+
+int Cache::slotsForLevel(int level) const {
+	if (metaCache != nullptr || level == 1) return optimalNumOfSlotsPerSlab;
+	int blocks = level == 0 ? Slab::blocksRequired(1, slotSize, alignment) : Slab::blocksRequired(optimalNumOfSlotsPerSlab, slotSize, alignment) << (level - 1);
+	if (blocks > TUNE_MAX_SLAB_BLOCKS) blocks = TUNE_MAX_SLAB_BLOCKS;
+	int slots = Slab::slotsThatFit(blocks * BLOCK_SIZE, slotSize, alignment);
+	return level == 0 ? (slots < optimalNumOfSlotsPerSlab ? slots : optimalNumOfSlotsPerSlab) : (slots > optimalNumOfSlotsPerSlab ? slots : optimalNumOfSlotsPerSlab);
+}
+
+
+void Cache::sampleLoad() {
+	long long now = now_ns();
+	double ms = (now - lastTuneNs) / 1e6;
+	opsPerMs = ms > 0 ? lockedOps / ms : 0;
+	contendedPercent = lockedOps > 0 ? (int)((long long)contendedOps * 100 / lockedOps) : 0;
+	lastTuneNs = now;
+	lockedOps = 0;
+	contendedOps = 0;
+}
+
+
+void Cache::retune() {
+	sampleLoad();
+	grownSinceTune = 0;
+	int level = tuneLevel;
+	if (opsPerMs >= TUNE_HOT_OPS_PER_MS && contendedPercent >= TUNE_CONTENDED_PERCENT) level++;
+	else if (level != 1) level += level < 1 ? 1 : -1;	// (level 0: growing again after it was idle)
+	if (level > TUNE_MAX_LEVEL) level = TUNE_MAX_LEVEL;
+	tuneLevel = level;
+	slotsPerSlab = slotsForLevel(level);
+}
+
+
+Slab* Cache::growSlab() {
+	if (TUNE_WINDOW > 0 && ++grownSinceTune >= TUNE_WINDOW) retune();
+	int slots = slotsPerSlab;
+	bool zero = zeroFreshSlabs;
+	int hp = hugePage;
+	// The buddy allocator, zeroing and constructors take long; allocations and frees from the
+	// slabs the cache has (mempool_alloc among them) do not wait for them.
+	m.unlock();
+	Slab* s = Slab::createSlab(this, slots, slotSize, alignment, constructor, metaCache, zero, asyncConstruction, &hp);
+	m.lock();
+	hugePage = hp;
+	if (!s) {
+		error_code = ERROR_NO_MEMORY;
+		return nullptr;
+	}
+	if (asyncConstruction) ConstructionPool::submit(s, constructor);	// (if the queue is full, allocations build the objects)
+	int slabs = ++numOfSlabs;
+	if (slabs > peakNumOfSlabs) peakNumOfSlabs = slabs;
+	numOfBlocks += s->getNumOfBlocks();
+	return s;
+}
+
+
+int Cache::prefill(int count) {
+	m.lock();
+	int ready = 0;
+	for (Slab* s = slabsFreeHead; s != nullptr; s = s->getNext()) ready += s->getNumOfSlots();
+	int added = 0;
+	while (ready < count) {
+		Slab* s = growSlab();
+		if (s == nullptr) {
+			m.unlock();
+			return -1;
+		}
+		pushSlab(slabsFreeHead, s);
+		ready += s->getNumOfSlots();
+		added++;
+	}
+	if (added > 0) {	// Shrinking right away would undo it.
+		slabAllocatedSinceLastShrink = true;
+		shrinkDone = false;
+	}
+	m.unlock();
+	return added;
+}
+
+
+int Cache::check() {
+	std::lock_guard<AdaptiveMutex> guard(m);
+	int slabs = 0, objects = 0;
+	auto walk = [&](Slab* head, int bucket) {	// bucket: -1 full, -2 free, otherwise partial
+		for (Slab* s = head; s != nullptr; s = s->getNext(), slabs++) {
+			if (slabs > numOfSlabs) return false;	// (a cycle)
+			if (s->getOwner() != this || Allocator::slab_of(s->getSpace()) != s) return false;
+			if (bucket == -1 ? !s->isFull() : bucket == -2 ? !s->isEmpty() : (s->isFull() || s->isEmpty() || partialBucket(s) != bucket)) return false;
+			objects += s->getSlotsOccupied();
+		}
+		return true;
+	};
+	bool ok = walk(slabsFullHead, -1) && walk(slabsFreeHead, -2);
+	for (int i = 0; i < PARTIAL_BUCKETS && ok; i++)
+		ok = walk(slabsPartial[i], i) && ((partialMask & (1u << i)) != 0) == (slabsPartial[i] != nullptr);
+	return ok && slabs == numOfSlabs ? objects : -1;
+}
+
+
+int Cache::destroySlab(Slab* s) {
+	s->waitForConstruction();	// (helpers do not take m)
+	s->destroyObjects(destructor);
+	int hp = Allocator::huge_page_of(s->getSpace());
+	if (hp >= 0) hugePage = hp;	// The next slab fills the hole.
+	int ret = Allocator::deallocate(s->getSpace(), s->getNumOfBlocks());
+	if (ret != 0) error_code = ERROR_DELETING_SLAB;
+	if (metaCache != nullptr) metaCache->free(s);	// Off-slab descriptor.
+	return ret;
+}
+
+
+void Cache::destroy() {
+//	if (m.try_lock() == false) return;	// Means that another thread is currently destroying this Cache.
+	m.lock();
+
+	Slab* cur = slabsFreeHead;
+	while (cur != nullptr) {
+		unlinkSlab(slabsFreeHead, cur);
+		destroySlab(cur);
+		cur = slabsFreeHead;
+	}
+	for (int i = 0; i < PARTIAL_BUCKETS; i++) {
+		cur = slabsPartial[i];
+		while (cur != nullptr) {
+			unlinkPartial(cur, i);
+			destroySlab(cur);
+			cur = slabsPartial[i];
+		}
+	}
+	cur = slabsFullHead;
+	while (cur != nullptr) {
+		unlinkSlab(slabsFullHead, cur);
+		destroySlab(cur);
+		cur = slabsFullHead;
+	}
+
+	if (metaCache != nullptr) {
+		metaCache->destroy();
+		Allocator::freeMemoryOfDestroyedCache(metaCache);
+		metaCache = nullptr;
+	}
+
+	m.unlock();
+
+	unlink();
+}
+
+
+int Cache::shrink(bool wait, bool idleCheck) {
+	if (!wait) {
+		if (!m.try_lock()) return 0;
+	}
+	else m.lock();
+
+	if (TUNE_WINDOW > 0 && idleCheck) {	// A cache found idle gets the smallest slabs; the sample of retune() goes on.
+		long long now = now_ns();
+		double ms = (now - idleCheckNs) / 1e6;
+		if (ms >= TUNE_IDLE_MIN_MS) {
+			if (idleOps / ms < TUNE_IDLE_OPS_PER_MS) {
+				sampleLoad();
+				tuneLevel = 0;
+				slotsPerSlab = slotsForLevel(0);
+			}
+			idleOps = 0;
+			idleCheckNs = now;
+		}
+	}
+	if (slabAllocatedSinceLastShrink) { // If slab allocation has occured since last shrinking, then return. 0 or some other value?
+		error_code = SHRINKING_AVOIDED;
+		m.unlock();
+		return 0; 
+	}
+	if (!slabsFreeHead) {
+		m.unlock();
+		return 0;
+	}
+	int blocks_freed = releaseFreeSlabs();
+	shrinkDone = true;
+
+	m.unlock();
+	return blocks_freed;
+}
+
+
+int Cache::releaseFreeSlabs() {
+	int blocks_freed = 0;
+	Slab* cur = slabsFreeHead;
+	while (cur != nullptr) {
+		unlinkSlab(slabsFreeHead, cur);
+		int blocks_cur = cur->getNumOfBlocks();
+		if (destroySlab(cur) == 0) blocks_freed += blocks_cur;	// Should always happen.
+		numOfSlabs--;
+		numOfBlocks -= blocks_cur;
+		cur = slabsFreeHead;
+	}
+	if (metaCache != nullptr) metaCache->shrink();	// Descriptors of the destroyed slabs are free now.
+	return blocks_freed;
+}
+
+
+int Cache::compact() {
+	if (relocator == nullptr) return -1;	// Error: objects of the cache cannot be moved.
+	m.lock();
+	Slab* pinned = nullptr;	// partial slabs with objects that the relocator refused to move
+	for (;;) {
+		// The emptiest slab is emptied into the fullest ones, if the other partial slabs have room for its objects.
+		Slab* src = emptiestPartial();
+		if (src == nullptr) break;
+		int room = 0;
+		for (int i = 0; i < PARTIAL_BUCKETS; i++)
+			for (Slab* s = slabsPartial[i]; s != nullptr; s = s->getNext())
+				if (s != src) room += s->getNumOfSlots() - s->getSlotsOccupied();
+		if (room < src->getSlotsOccupied()) break;	// (no other slab has fewer objects)
+		unlinkPartial(src, partialBucket(src));	// It must not become a target.
+
+		bool refused = false;
+		for (int i = 0; i < src->getNumOfSlots() && !src->isEmpty(); i++) {
+			void* from = src->usedSlot(i);
+			if (from == nullptr) continue;
+			void* to = allocFromPartial(fullestPartial(), false);
+			if (relocator(from, to) == 0) {
+				freeObject(to);
+				refused = true;
+				break;
+			}
+			src->free(from);
+		}
+		if (src->isEmpty()) pushSlab(slabsFreeHead, src);
+		else if (refused) pushSlab(pinned, src);
+		else pushPartial(src);
+	}
+	while (pinned != nullptr) {
+		Slab* s = pinned;
+		unlinkSlab(pinned, s);
+		pushPartial(s);
+	}
+	int blocks_freed = releaseFreeSlabs();
+	m.unlock();
+	return blocks_freed;
+}
+
+
+void Cache::info() {
+	m.lock();
+	std::string s = "";
+	s += name; s += '\n';
+	s += std::to_string(slotSize); s += " B/obj\n";
+	int slots_occupied = 0;
+	int total_slots = 0;
+	int blocks = 0;	// (slabs of a tuned cache differ in size)
+	for (Slab* s = slabsFullHead; s != nullptr; s = s->getNext()) {
+		slots_occupied += s->getSlotsOccupied();
+		total_slots += s->getNumOfSlots();
+		blocks += s->getNumOfBlocks();
+	}
+	for (int i = 0; i < PARTIAL_BUCKETS; i++)
+		for (Slab* s = slabsPartial[i]; s != nullptr; s = s->getNext()) {
+			slots_occupied += s->getSlotsOccupied();
+			total_slots += s->getNumOfSlots();
+			blocks += s->getNumOfBlocks();
+		}
+	for (Slab* s = slabsFreeHead; s != nullptr; s = s->getNext()) {
+		total_slots += s->getNumOfSlots();
+		blocks += s->getNumOfBlocks();
+	}
+	s += std::to_string(blocks); s += " blocks\n";
+	if (metaCache != nullptr) { s += "off-slab, descriptors in "; s += metaCache->name; s += '\n'; }
+	s += std::to_string(numOfSlabs); s += " slabs\n";
+	s += std::to_string(peakNumOfSlabs); s += " slabs at peak\n";
+	s += std::to_string(slotsPerSlab); s += " obj/slab";
+	if (slotsPerSlab != optimalNumOfSlotsPerSlab) { s += " (tuned, optimal "; s += std::to_string(optimalNumOfSlotsPerSlab); s += ")"; }
+	s += '\n';
+	s += "tuning level "; s += std::to_string(tuneLevel); s += ", "; s += std::to_string((long)opsPerMs); s += " ops/ms, ";
+	s += std::to_string(contendedPercent); s += "% contended\n";
+	if (alignments > 1) { s += std::to_string(alignments); s += " colors of "; s += std::to_string(colorSize); s += " B\n"; }
+	if (total_slots != 0) {
+		s += std::to_string((float)slots_occupied / total_slots * 100);
+		s += "% full\n";
+	}
+	else
+		s += "cache has no slots\n";
+	std::cout << s << std::endl;
+	m.unlock();
+}
+
+
+
+
+
+
+size_t Cache::getObjectAlignment() const {
+	size_t a = alignment > SLAB_OBJECT_ALIGNMENT ? alignment : SLAB_OBJECT_ALIGNMENT;	// alignment of object_space
+	while (slotSize % a != 0) a /= 2;
+	return a;
+}
+
+
+bool Cache::canMergeWith(size_t size, size_t align) const {
+	// Like SLUB: no constructors, the slot is large enough, and it is not larger by a pointer or more.
+	if (!mergeable || constructor != nullptr || destructor != nullptr) return false;
+	size_t needed = (size + align - 1) / align * align;
+	return slotSize >= needed && slotSize - needed < sizeof(void*) && getObjectAlignment() >= align;
+}
+
+
+
+
+
+
+kmem_cache_s::kmem_cache_s(Cache* cache, const char* name, bool owner) : c(cache), nextHandle(nullptr), metricsSlot(Metrics::acquireSlot()), owner(owner) {
+	snprintf(this->name, NAME_LENGTH, "%s", name);
+}
+
+
+void kmem_cache_s::info() const {
+	if (!c) {
+		std::cout << "Handle does not point to any cache!" << std::endl;
+		return;
+	}
+	if (!owner) {	// Merged into a cache created through another handle (maybe under the same name).
+		std::string s = "";
+		s += name; s += " (alias of "; s += c->getName(); s += ")\n";
+		long long allocs = Metrics::read(metricsSlot, METRIC_ALLOCS), frees = Metrics::read(metricsSlot, METRIC_FREES);
+		s += std::to_string(allocs - frees); s += " obj in use\n";
+		s += std::to_string(allocs); s += " allocs, ";
+		s += std::to_string(frees); s += " frees, ";
+		s += std::to_string(Metrics::read(metricsSlot, METRIC_FAILURES)); s += " failures";
+		std::cout << s << std::endl;
+	}
+	c->info();
+}
+
+
+int kmem_cache_s::error() const {
+	int ec = c->getErrorCode();
+	switch (ec) {
+	case 0: std::cout << "NO ERROR." << std::endl; break;
+	case ERROR_NO_MEMORY: std::cout << "NO MEMORY AVAILABLE!" << std::endl; break;
+	case ERROR_FREEING_OBJECT: std::cout << "ERROR FREEING OBJECT!" << std::endl; break;
+	case ERROR_DELETING_SLAB: std::cout << "ERROR DELETING SLAB!" << std::endl; break;
+	case SHRINKING_AVOIDED: std::cout << "SHRINKING AVOIDED!" << std::endl; break;
+	default: std::cout << "UNDEFINED ERROR!" << std::endl; break;
+	}
+	return ec;
 }
\ No newline at end of file
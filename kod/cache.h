@@ -1,103 +1,297 @@
-#pragma once
-
-
-#include <mutex>
-#include <iostream>
-
-
-#define NAME_LENGTH (20)
-
-#define ERROR_NO_MEMORY (1)
-#define ERROR_FREEING_OBJECT (2)
-#define ERROR_DELETING_SLAB (3)
-#define SHRINKING_AVOIDED (4)
-
-
-class Allocator;
-class Slab;
-
-
-
-class Cache {
-private:
-	char name[NAME_LENGTH];
-	size_t slotSize;
-	int optimalNumOfSlotsPerSlab;
-	void (*constructor)(void *);
-	void (*destructor)(void *);
-
-	static Cache* headCache;
-	Cache* nextCache;
-
-	Slab* slabsFullHead;
-	Slab* slabsPartialHead;
-	Slab* slabsFreeHead;
-	int numOfSlabs;
-
-	bool slabAllocatedSinceLastShrink;
-	bool shrinkDone;
-
-	int alignments;
-	int current_alignment;
-
-	int error_code;
-
-	int destroySlab(Slab* s);
-
-	Cache(const char* name, size_t size, void (*ctor)(void *), void (*dtor)(void *));
-
-	std::recursive_mutex m;
-public:
-	static Cache* createCache(const char* name, size_t size, void(*ctor)(void *), void(*dtor)(void *));
-	static Cache* createCacheForCaches();
-
-	inline static Cache* getHeadCache() {
-		return headCache;
-	}
-
-	inline Cache* getNextCache() const {
-		return nextCache;
-	}
-
-	int shrink();
-	void* alloc();
-	bool free(void* objp);
-	void destroy();
-	void info();
-
-	inline int getErrorCode() const {
-		return error_code;
-	}
-};
-
-
-
-struct kmem_cache_s {
-private:
-	friend class Allocator;
-	Cache* c;
-
-	inline void destroy() {
-		if (c) c->destroy();
-		else exit(3);
-	}
-public:
-	kmem_cache_s(Cache* cache);
-	inline int shrink() const {
-		if (c) return c->shrink();
-		else exit(3);
-	}
-	inline void* alloc() const {
-		if (c) return c->alloc();
-		else exit(3);
-	}
-	inline bool free(void* objp) const {
-		if (c) return c->free(objp);
-		else exit(3);
-	}
-	inline void info() const {
-		if (c) c->info();
-		else std::cout << "Handle does not point to any cache!" << std::endl;
-	}
-	int error() const;
+#pragma once
+
+
+#include <mutex>
+#include <atomic>
+#include <iostream>
+#include "slab.h"
+#include "lock.h"
+#include "metrics.h"
+
+
+#define NAME_LENGTH (20)
+
+#define ERROR_NO_MEMORY (1)
+#define ERROR_FREEING_OBJECT (2)
+#define ERROR_DELETING_SLAB (3)
+#define SHRINKING_AVOIDED (4)
+
+#ifndef OFF_SLAB_THRESHOLD
+#define OFF_SLAB_THRESHOLD (BLOCK_SIZE / 4)	// slabs of objects at least this large keep their descriptors in a metadata cache
+#endif
+
+#ifndef MAX_PAGE_COLORS
+#define MAX_PAGE_COLORS (64)	// blocks in one way of the L2 cache that are told apart by coloring (see Allocator::page_color)
+#endif
+
+// Slab size tuning (see Cache::retune): every TUNE_WINDOW new slabs, a cache whose allocations and frees
+// come at TUNE_HOT_OPS_PER_MS or faster and find its lock held TUNE_CONTENDED_PERCENT of the time or more
+// goes one level up (slabs twice as large, so it grows less often); a cool one goes back towards level 1.
+// A kmem_cache_shrink that finds the cache idle drops it to level 0, the smallest slab that holds an object;
+// the shrinks that follow frees leave the tuning state alone.
+#ifndef TUNE_WINDOW
+#define TUNE_WINDOW (4)	// 0 turns tuning off
+#endif
+#define TUNE_MAX_LEVEL (3)	// level l > 1: optimal slabs times 2^(l-1) blocks, at most TUNE_MAX_SLAB_BLOCKS
+#define TUNE_MAX_SLAB_BLOCKS (4 * MAX_SLAB_BLOCKS)
+#define TUNE_HOT_OPS_PER_MS (1000)
+#ifndef TUNE_CONTENDED_PERCENT
+#define TUNE_CONTENDED_PERCENT (5)
+#endif
+#define TUNE_IDLE_OPS_PER_MS (1)	// kmem_cache_shrink finds the cache idle below this rate since the previous one
+#define TUNE_IDLE_MIN_MS (10)	// shrinks closer to the previous one do not judge
+
+#ifndef PARTIAL_BUCKETS
+#define PARTIAL_BUCKETS (8)	// partial slabs are grouped by occupancy; 1 gives a single list
+#endif
+
+
+class Allocator;
+class Slab;
+
+
+
+class Cache {
+private:
+	char name[NAME_LENGTH];
+	size_t slotSize;	// object size rounded up to the alignment
+	size_t alignment;
+	int optimalNumOfSlotsPerSlab;
+	void (*constructor)(void *);
+	void (*destructor)(void *);
+
+	// Registry of caches (meta caches are reached through their owners): read without locks
+	// between Epoch::enter() and Epoch::exit(), written under Allocator::caches_m.
+	// Unlinked caches and handles are freed only after Epoch::waitForReaders().
+	static std::atomic<Cache*> headCache;
+	std::atomic<Cache*> nextCache;
+	std::atomic<kmem_cache_s*> handles;	// handles of the cache, under the same rules as the registry
+
+	Slab* slabsFullHead;
+	Slab* slabsPartial[PARTIAL_BUCKETS];	// slabsPartial[i] holds slabs that are between i/PARTIAL_BUCKETS and (i+1)/PARTIAL_BUCKETS full
+	unsigned partialMask;	// bit i is set if slabsPartial[i] is not empty
+	Slab* slabsFreeHead;
+	// Statistics and the error code are written under m but read without it.
+	std::atomic<int> numOfSlabs;
+	std::atomic<int> peakNumOfSlabs;
+	std::atomic<int> numOfBlocks;	// of all slabs
+	int metricsSlot;	// allocations, frees and failures (see Metrics), taken while the cache is in the registry
+
+	bool slabAllocatedSinceLastShrink;
+	bool shrinkDone;
+
+	int alignments;	// number of colors
+	int colorSize;	// bytes between two colors, a multiple of the alignment and of the cache line
+	unsigned colorFlags;	// SLAB_COLOR_PER_THREAD, SLAB_NO_COLOR
+	unsigned short colorOfPage[MAX_PAGE_COLORS];	// next color of a slab that starts in a block of the given page color
+	int hugePage;	// huge page that new slabs are taken from (see Allocator::buddy_alloc_exact), -1 for none
+
+	Cache* metaCache;	// holds the Slab objects and bufctl arrays of off-slab caches, nullptr for on-slab ones
+
+	bool zeroFreshSlabs;	// set by the first zeroed allocation: new slabs are then zeroed as a whole
+	bool asyncConstruction;	// SLAB_ASYNC_CTOR: new slabs are built by ConstructionPool, one free slab is kept ahead
+
+	int (*relocator)(void* from, void* to);	// movable caches only, see compact()
+
+	// Tuning state, under m. Off-slab caches stay at the optimal size (their descriptors have a fixed size).
+	int tuneLevel;
+	int slotsPerSlab;	// of new slabs
+	int lockedOps;	// allocations and frees since the last retune
+	int contendedOps;	// those of them that found m held
+	int grownSinceTune;
+	long long lastTuneNs;
+	double opsPerMs;	// as measured by the last retune
+	int contendedPercent;
+	int idleOps;	// allocations and frees since the last idle check (see shrink)
+	long long idleCheckNs;
+
+	std::atomic<int> error_code;
+
+	int numOfHandles;	// handles (kmem_cache_t) that share the cache
+	bool mergeable;	// other handles may share the cache (see Allocator::cache_create)
+
+	int destroySlab(Slab* s);	// m must be held
+	Slab* growSlab();	// creates a slab that is not in any list yet, nullptr if there is no memory; m must be held, it is released while the slab is built
+	void lockCounted();	// locks m, counting the operation for tuning
+	void retune();	// m must be held
+	void sampleLoad();	// measures opsPerMs and contendedPercent since the last sample, starts a new one
+	int slotsForLevel(int level) const;
+
+	void link();	// adds the cache to the registry
+	void unlink();
+
+	static void pushSlab(Slab*& head, Slab* s);
+	static void unlinkSlab(Slab*& head, Slab* s);
+
+	static int partialBucket(Slab* s);
+	void pushPartial(Slab* s);
+	void unlinkPartial(Slab* s, int bucket);
+	Slab* fullestPartial();	// nullptr if there are no partial slabs
+	Slab* emptiestPartial();
+	void* allocFromPartial(Slab* s, bool zero);	// keeps s in the right list; m must be held
+	int releaseFreeSlabs();	// gives all free slabs back, returns the number of blocks; m must be held
+
+	bool freeObject(void* objp);	// free() without locking
+
+	Cache(const char* name, size_t size, size_t align, void (*ctor)(void *), void (*dtor)(void *), bool offSlabAllowed = true);
+	static Cache* createMetaCache(const char* name, int numOfSlots);	// always on-slab
+
+	alignas(CACHE_L1_LINE_SIZE) AdaptiveMutex m;	// slab lists; not recursive, so constructors must not use their own cache
+public:
+	static Cache* createCache(const char* name, size_t size, void(*ctor)(void *), void(*dtor)(void *), size_t align = 1, unsigned flags = 0);	// align: power of 2, at most BLOCK_SIZE
+	static Cache* createCacheForCaches();
+
+	inline static Cache* getHeadCache() {
+		return headCache.load(std::memory_order_acquire);
+	}
+
+	inline Cache* getNextCache() const {
+		return nextCache.load(std::memory_order_acquire);
+	}
+
+	inline kmem_cache_s* getFirstHandle() const {
+		return handles.load(std::memory_order_acquire);
+	}
+
+	int shrink(bool wait = true, bool idleCheck = false);	// wait == false: nothing is done if another thread holds the cache; idleCheck: see TUNE_IDLE_OPS_PER_MS
+	// Moves objects out of the emptiest partial slabs into the fullest ones and frees the emptied slabs,
+	// returns the number of blocks freed (-1 if the cache is not movable). For every object,
+	// relocator(from, to) must move it into the allocated slot to, update its owners and leave from
+	// as a freed object (e.g. constructed); it returns 0 to keep the object where it is.
+	// It runs with m held, so it must not use this cache.
+	int compact();
+	int prefill(int count);	// adds free slabs until they hold count objects, returns the number added (-1 if out of memory)
+	int check();	// walks the slab lists: returns the number of allocated objects, -1 if a slab is in the wrong list or numOfSlabs is off
+	inline void setRelocator(int (*relocate)(void* from, void* to)) {
+		relocator = relocate;
+	}
+	void* alloc(bool grow = true, bool zero = false);	// grow == false: only existing slabs are used, nullptr if they are full
+	bool free(void* objp);
+	int freeBulk(void** objs, int n);	// one lock for all objects, returns the number freed
+	void destroy();	// also unlinks the cache from the registry
+	int nextColor(const void* slabSpace);	// offset of the first object of a new slab at slabSpace; takes m
+	void info();
+
+	inline int getErrorCode() const {
+		return error_code;
+	}
+
+	inline int getNumOfSlabs() const {
+		return numOfSlabs;
+	}
+
+	inline int getPeakNumOfSlabs() const {
+		return peakNumOfSlabs;
+	}
+
+	inline int getNumOfBlocks() const {
+		return numOfBlocks;
+	}
+
+	inline int getMetricsSlot() const {
+		return metricsSlot;
+	}
+
+	inline int getTuneLevel() const {	// (read without m, for statistics)
+		return tuneLevel;
+	}
+
+	inline int getSlotsPerSlab() const {
+		return slotsPerSlab;
+	}
+
+	inline const char* getName() const {
+		return name;
+	}
+
+	inline size_t getSlotSize() const {
+		return slotSize;
+	}
+
+	inline bool isOffSlab() const {
+		return metaCache != nullptr;
+	}
+
+	size_t getObjectAlignment() const;	// alignment that every object of the cache has
+
+	bool canMergeWith(size_t size, size_t align) const;
+	inline void setMergeable(bool m) {
+		mergeable = m;
+	}
+
+	void addHandle(kmem_cache_s* h);
+	int removeHandle(kmem_cache_s* h);	// returns the number of handles left
+};
+
+
+
+// Handle of a cache. Several handles may share one cache (merged caches);
+// each keeps its own name and statistics.
+struct kmem_cache_s {
+private:
+	friend class Allocator;
+	friend class Cache;
+	Cache* c;
+
+	char name[NAME_LENGTH];
+	std::atomic<kmem_cache_s*> nextHandle;	// see Cache::handles
+	int metricsSlot;	// allocations, frees and failures through this handle, counted per thread (see Metrics)
+	bool owner;	// the cache was created through this handle, other handles were merged into it
+public:
+	kmem_cache_s(Cache* cache, const char* name, bool owner);
+	inline const char* getName() const {
+		return name;
+	}
+	inline kmem_cache_s* getNextHandle() const {
+		return nextHandle.load(std::memory_order_acquire);
+	}
+	inline int shrink() const {
+		if (c) return c->shrink(true, true);
+		else exit(3);
+	}
+	inline int compact() const {
+		if (c) return c->compact();
+		else exit(3);
+	}
+	inline int prefill(int count) const {
+		if (c) return c->prefill(count);
+		else exit(3);
+	}
+	inline void* alloc(bool grow = true, bool zero = false) const {
+		if (!c) exit(3);
+		void* ret = c->alloc(grow, zero);
+		if (ret) Metrics::count(metricsSlot, METRIC_ALLOCS);
+		else if (grow) Metrics::count(metricsSlot, METRIC_FAILURES);
+		return ret;
+	}
+	inline bool free(void* objp) const {
+		if (!c) exit(3);
+		bool ret = c->free(objp);
+		Metrics::count(metricsSlot, ret ? METRIC_FREES : METRIC_FAILURES);
+		return ret;
+	}
+	inline int freeBulk(void** objs, int n) const {
+		if (!c) exit(3);
+		int ret = c->freeBulk(objs, n);
+		Metrics::count(metricsSlot, METRIC_FREES, ret);
+		if (ret < n) Metrics::count(metricsSlot, METRIC_FAILURES, n - ret);
+		return ret;
+	}
+	inline int numOfSlabs() const {
+		return c ? c->getNumOfSlabs() : 0;
+	}
+	inline int check() const {
+		return c ? c->check() : -1;
+	}
+	inline int tuneLevel() const {
+		return c ? c->getTuneLevel() : 0;
+	}
+	inline int slotsPerSlab() const {
+		return c ? c->getSlotsPerSlab() : 0;
+	}
+	inline int peakNumOfSlabs() const {
+		return c ? c->getPeakNumOfSlabs() : 0;
+	}
+	void info() const;
+	int error() const;
 };
\ No newline at end of file
@@ -0,0 +1,68 @@
+#include "construction pool.h"
+#include "slab class.h"
+#include <thread>
+#include <system_error>
+
+
+
+AdaptiveMutex ConstructionPool::m;
+WaitCounter ConstructionPool::submitted;
+ConstructionJob ConstructionPool::queue[CONSTRUCTION_QUEUE_LENGTH];
+int ConstructionPool::head = 0;
+int ConstructionPool::count = 0;
+int ConstructionPool::threads = 0;
+std::atomic<bool> ConstructionPool::started(false);
+
+
+bool ConstructionPool::submit(Slab* s, void (*constructor)(void *)) {
+	if (!started.load(std::memory_order_acquire)) start();
+	m.lock();
+	if (count == CONSTRUCTION_QUEUE_LENGTH || threads == 0) {
+		m.unlock();
+		return false;
+	}
+	s->beginConstruction();
+	queue[(head + count++) % CONSTRUCTION_QUEUE_LENGTH] = { s, constructor };
+	m.unlock();
+	submitted.advance();
+	return true;
+}
+
+
+bool ConstructionPool::take(ConstructionJob& job) {
+	std::lock_guard<AdaptiveMutex> guard(m);
+	if (count == 0) return false;
+	job = queue[head];
+	head = (head + 1) % CONSTRUCTION_QUEUE_LENGTH;
+	count--;
+	return true;
+}
+
+
+void ConstructionPool::work() {
+	for (;;) {
+		int seen = submitted.load();	// (before the queue is looked at, so no submission is missed)
+		ConstructionJob job;
+		if (!take(job)) {
+			submitted.waitWhile(seen);
+			continue;
+		}
+		job.slab->constructSlots(job.constructor);
+	}
+}
+
+
+void ConstructionPool::start() {
+	std::lock_guard<AdaptiveMutex> guard(m);
+	if (started.load(std::memory_order_relaxed)) return;
+	for (int i = 0; i < CONSTRUCTION_THREADS; i++) {
+		try {
+			std::thread(work).detach();	// They sleep until the process ends.
+			threads++;
+		}
+		catch (const std::system_error&) {	// With no helpers at all, nothing is queued.
+			break;
+		}
+	}
+	started.store(true, std::memory_order_release);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+
+#include <atomic>
+#include "lock.h"
+
+
+#ifndef CONSTRUCTION_THREADS
+#define CONSTRUCTION_THREADS (2)	// helper threads, started with the first SLAB_ASYNC_CTOR slab
+#endif
+#define CONSTRUCTION_QUEUE_LENGTH (256)	// slabs waiting for the helpers; the objects of further ones are built on allocation
+
+
+class Slab;
+
+
+struct ConstructionJob {
+	Slab* slab;
+	void (*constructor)(void *);
+};
+
+
+// Helper threads for caches with expensive constructors (SLAB_ASYNC_CTOR). New slabs are queued
+// and their objects are built in slot order without the cache's lock, while the slabs are already
+// in the cache's lists. An allocation that gets to a slot first builds the object itself, or waits
+// for the helper that is building it (see Slab::claimSlot), so nothing waits for the whole queue.
+// A slab is not destroyed while it is queued or being built (see Slab::waitForConstruction).
+class ConstructionPool {
+private:
+	static AdaptiveMutex m;	// the queue
+	static WaitCounter submitted;
+	static ConstructionJob queue[CONSTRUCTION_QUEUE_LENGTH];
+	static int head;
+	static int count;
+	static int threads;	// helpers that have been started
+	static std::atomic<bool> started;
+
+	static bool take(ConstructionJob& job);
+	static void work();
+	static void start();
+public:
+	static bool submit(Slab* s, void (*constructor)(void *));	// false if it could not be queued: then s is constructed on allocation
+};
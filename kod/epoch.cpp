@@ -0,0 +1,225 @@
+#include "epoch.h"
+#include "allocator.h"
+#include <new>
+#include <thread>
+
+
+
+std::atomic<unsigned long> Epoch::globalEpoch(EPOCH_LIMBO_LISTS);	// limboEpoch of new records (0) is then always old enough
+std::atomic<EpochRecord*> Epoch::records(nullptr);
+EpochRecord Epoch::staticRecords[EPOCH_STATIC_RECORDS];
+std::atomic<int> Epoch::staticRecordsUsed(0);
+RetiredBatch* Epoch::orphans = nullptr;
+std::mutex Epoch::orphansMutex;
+
+
+static thread_local EpochRecord* thread_record = nullptr;
+
+struct EpochThreadExit {	// gives the limbo lists away when the thread finishes
+	~EpochThreadExit() {
+		Epoch::threadExit();
+	}
+};
+static thread_local EpochThreadExit thread_exit;
+
+
+EpochRecord* Epoch::self() {
+	if (thread_record != nullptr) return thread_record;
+	(void)&thread_exit;	// The destructor runs only for threads that have touched it.
+	for (EpochRecord* r = records.load(); r != nullptr; r = r->next) {
+		bool expected = false;
+		if (!r->inUse.load() && r->inUse.compare_exchange_strong(expected, true)) return thread_record = r;
+	}
+	// The main thread's record is written by its thread_local destructor, which may run after the
+	// space has been given back (at exit), so the first records are static.
+	int i = staticRecordsUsed.fetch_add(1);
+	void* loc = i < EPOCH_STATIC_RECORDS ? &staticRecords[i] : Allocator::malloc(sizeof(EpochRecord));
+	if (loc == nullptr) return nullptr;	// error
+	EpochRecord* r = new (loc) EpochRecord();	// Placement new!
+	r->state.store(0);
+	r->inUse.store(true);
+	r->nesting = 0;
+	r->retiredSinceCollect = 0;
+	for (int i = 0; i < EPOCH_LIMBO_LISTS; i++) {
+		r->limboEpoch[i] = 0;
+		r->limbo[i] = nullptr;
+	}
+	r->next = records.load();
+	while (!records.compare_exchange_weak(r->next, r));
+	return thread_record = r;
+}
+
+
+void Epoch::enter() {
+	EpochRecord* r = self();
+	if (r == nullptr) ::exit(5);	// Fatal error: readers cannot be protected.
+	if (r->nesting++ > 0) return;
+	// The store must be visible before the reader loads any shared pointer.
+	r->state.store((globalEpoch.load() << 1) | 1);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+
+void Epoch::exit() {
+	EpochRecord* r = thread_record;
+	if (r == nullptr || r->nesting == 0) return;	// error
+	if (--r->nesting == 0) r->state.store(0, std::memory_order_release);
+}
+
+
+bool Epoch::tryAdvance() {
+	unsigned long e = globalEpoch.load();
+	for (EpochRecord* r = records.load(); r != nullptr; r = r->next) {
+		unsigned long s = r->state.load();
+		if ((s & 1) && (s >> 1) != e) return false;	// A reader has not seen epoch e yet.
+	}
+	return globalEpoch.compare_exchange_strong(e, e + 1);
+}
+
+
+void Epoch::releaseBatch(RetiredBatch* b) {
+	b->cache->freeBulk(b->objs, b->count);
+	Allocator::free_sized(b, sizeof(RetiredBatch));
+}
+
+
+void Epoch::collect(EpochRecord* r) {
+	unsigned long e = globalEpoch.load();
+	for (int i = 0; i < EPOCH_LIMBO_LISTS; i++) {
+		if (r->limbo[i] == nullptr || r->limboEpoch[i] + 2 > e) continue;
+		RetiredBatch* b = r->limbo[i];
+		r->limbo[i] = nullptr;
+		while (b != nullptr) {
+			RetiredBatch* next = b->next;
+			releaseBatch(b);
+			b = next;
+		}
+	}
+	r->retiredSinceCollect = 0;
+
+	std::unique_lock<std::mutex> lock(orphansMutex, std::try_to_lock);
+	if (!lock.owns_lock() || orphans == nullptr) return;
+	RetiredBatch* ready = nullptr;
+	for (RetiredBatch** pb = &orphans; *pb != nullptr;) {
+		RetiredBatch* b = *pb;
+		if (b->epoch + 2 <= e) {
+			*pb = b->next;
+			b->next = ready;
+			ready = b;
+		}
+		else pb = &b->next;
+	}
+	lock.unlock();
+	while (ready != nullptr) {
+		RetiredBatch* next = ready->next;
+		releaseBatch(ready);
+		ready = next;
+	}
+}
+
+
+void Epoch::freeAfterGracePeriod(const kmem_cache_t* cachep, void* objp) {
+	if (waitForReaders() < 0) {
+		std::cout << "NO MEMORY TO DEFER FREEING OF AN OBJECT, IT IS LEAKED!" << std::endl;
+		return;
+	}
+	cachep->free(objp);
+}
+
+
+int Epoch::waitForReaders() {
+	EpochRecord* r = thread_record;
+	if (r != nullptr && r->nesting > 0) return -1;	// Error: the grace period would wait for this very thread.
+	unsigned long e = globalEpoch.load();
+	while (globalEpoch.load() < e + 2) {
+		if (!tryAdvance()) std::this_thread::yield();
+	}
+	return 0;
+}
+
+
+void Epoch::retire(const kmem_cache_t* cachep, void* objp) {
+	EpochRecord* r = self();
+	if (r == nullptr) {	// error
+		freeAfterGracePeriod(cachep, objp);
+		return;
+	}
+	unsigned long e = globalEpoch.load();
+	int i = e % EPOCH_LIMBO_LISTS;
+	if (r->limboEpoch[i] != e) {	// The list still holds objects of epoch e - 3 (or older), which can go now.
+		collect(r);
+		r->limboEpoch[i] = e;
+	}
+	RetiredBatch* b = r->limbo[i];
+	while (b != nullptr && (b->cache != cachep || b->count == EPOCH_BATCH_SIZE)) b = b->next;
+	if (b == nullptr) {
+		b = (RetiredBatch*)Allocator::malloc(sizeof(RetiredBatch));
+		if (b == nullptr) {	// error
+			freeAfterGracePeriod(cachep, objp);
+			return;
+		}
+		b->cache = cachep;
+		b->count = 0;
+		b->next = r->limbo[i];
+		r->limbo[i] = b;
+	}
+	b->epoch = e;
+	b->objs[b->count++] = objp;
+
+	if (++r->retiredSinceCollect >= EPOCH_COLLECT_THRESHOLD) {
+		tryAdvance();
+		collect(r);
+	}
+}
+
+
+bool Epoch::isIdle(EpochRecord* r) {
+	for (int i = 0; i < EPOCH_LIMBO_LISTS; i++)
+		if (r->limbo[i] != nullptr) return false;
+	std::lock_guard<std::mutex> lock(orphansMutex);
+	return orphans == nullptr;
+}
+
+
+int Epoch::synchronize() {
+	EpochRecord* r = self();
+	if (r == nullptr) return -1;	// error
+	if (r->nesting > 0) {
+		std::cout << "EPOCH CANNOT BE SYNCHRONIZED INSIDE A CRITICAL SECTION!" << std::endl;
+		return -1;
+	}
+	while (!isIdle(r)) {
+		tryAdvance();
+		collect(r);
+		std::this_thread::yield();
+	}
+	return 0;
+}
+
+
+void Epoch::threadExit() {
+	EpochRecord* r = thread_record;
+	if (r == nullptr) return;
+	thread_record = nullptr;
+	r->nesting = 0;
+	r->state.store(0);
+	RetiredBatch* left = nullptr;
+	for (int i = 0; i < EPOCH_LIMBO_LISTS; i++) {
+		while (r->limbo[i] != nullptr) {
+			RetiredBatch* b = r->limbo[i];
+			r->limbo[i] = b->next;
+			b->next = left;
+			left = b;
+		}
+		r->limboEpoch[i] = 0;
+	}
+	r->retiredSinceCollect = 0;
+	if (left != nullptr) {
+		std::lock_guard<std::mutex> lock(orphansMutex);
+		RetiredBatch* last = left;
+		while (last->next != nullptr) last = last->next;
+		last->next = orphans;
+		orphans = left;
+	}
+	r->inUse.store(false);
+}
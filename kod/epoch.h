@@ -0,0 +1,64 @@
+#pragma once
+
+
+#include <atomic>
+#include <mutex>
+#include "slab.h"
+#include "cache.h"
+
+
+#define EPOCH_BATCH_SIZE (64)	// retired objects of one cache that are freed under one lock
+#define EPOCH_COLLECT_THRESHOLD (2 * EPOCH_BATCH_SIZE)	// retired objects between two attempts to advance the epoch
+#define EPOCH_LIMBO_LISTS (3)	// objects retired in epoch e are freed once the global epoch reaches e + 2
+#define EPOCH_STATIC_RECORDS (8)	// records of the first threads are not in the allocator's space (see Epoch::self)
+
+
+
+// Epoch-based reclamation, for objects of lock-free structures that readers may still see.
+// Readers run between enter() and exit(). Retired objects wait in per-thread limbo lists,
+// one for each of the last three epochs, in batches of objects of the same cache.
+// The global epoch advances only when every thread inside a critical section has seen it,
+// so two advances make a grace period.
+struct RetiredBatch {
+	const kmem_cache_t* cache;
+	unsigned long epoch;
+	int count;
+	RetiredBatch* next;
+	void* objs[EPOCH_BATCH_SIZE];
+};
+
+
+struct EpochRecord {
+	std::atomic<unsigned long> state;	// (epoch << 1) | 1 inside a critical section, 0 outside
+	std::atomic<bool> inUse;	// records of finished threads are reused
+	EpochRecord* next;
+	int nesting;
+	int retiredSinceCollect;
+	unsigned long limboEpoch[EPOCH_LIMBO_LISTS];
+	RetiredBatch* limbo[EPOCH_LIMBO_LISTS];
+};
+
+
+class Epoch {
+private:
+	static std::atomic<unsigned long> globalEpoch;
+	static std::atomic<EpochRecord*> records;	// records are only added to the list, never removed
+	static EpochRecord staticRecords[EPOCH_STATIC_RECORDS];
+	static std::atomic<int> staticRecordsUsed;
+	static RetiredBatch* orphans;	// batches left by finished threads
+	static std::mutex orphansMutex;
+
+	static EpochRecord* self();	// record of the calling thread, nullptr if there is no memory for one
+	static bool tryAdvance();
+	static void collect(EpochRecord* r);	// frees the batches whose grace period has passed
+	static void releaseBatch(RetiredBatch* b);
+	static void freeAfterGracePeriod(const kmem_cache_t* cachep, void* objp);	// when there is no memory for batching
+	static bool isIdle(EpochRecord* r);
+public:
+	static void enter();
+	static void exit();
+	static void retire(const kmem_cache_t* cachep, void* objp);
+	static int synchronize();	// waits until everything the calling thread (and finished threads) retired is freed
+	static int waitForReaders();	// waits until every critical section that has begun before the call has ended
+	static void threadExit();	// hands the limbo lists of the calling thread over to the others
+};
@@ -0,0 +1,103 @@
+#pragma once
+
+
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#define LOCK_PAUSE() _mm_pause()
+#else
+#define LOCK_PAUSE() std::this_thread::yield()
+#endif
+
+
+#ifndef LOCK_SPIN_LIMIT
+#define LOCK_SPIN_LIMIT (100)	// attempts before a waiting thread goes to sleep
+#endif
+
+
+// Non-recursive lock: a compare-and-swap when it is free, a bounded spin while it is held,
+// then sleeping on a futex (yielding where there are no futexes). Usable with std::lock_guard.
+// state: 0 free, 1 held, 2 held and somebody may sleep on it.
+class AdaptiveMutex {
+private:
+	std::atomic<int> state;
+
+	void wait() {
+#ifdef __linux__
+		syscall(SYS_futex, (int*)&state, FUTEX_WAIT_PRIVATE, 2, nullptr, nullptr, 0);
+#else
+		std::this_thread::yield();
+#endif
+	}
+
+	void wake() {
+#ifdef __linux__
+		syscall(SYS_futex, (int*)&state, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+	}
+
+	void lockContended() {
+		for (int i = 0; i < LOCK_SPIN_LIMIT; i++) {
+			LOCK_PAUSE();
+			int c = 0;
+			if (state.load(std::memory_order_relaxed) == 0 && state.compare_exchange_weak(c, 1, std::memory_order_acquire)) return;
+		}
+		while (state.exchange(2, std::memory_order_acquire) != 0) wait();
+	}
+public:
+	AdaptiveMutex() : state(0) {}
+	AdaptiveMutex(const AdaptiveMutex&) = delete;
+	AdaptiveMutex& operator=(const AdaptiveMutex&) = delete;
+
+	inline void lock() {
+		int c = 0;
+		if (!state.compare_exchange_strong(c, 1, std::memory_order_acquire)) lockContended();
+	}
+
+	inline bool try_lock() {
+		int c = 0;
+		return state.compare_exchange_strong(c, 1, std::memory_order_acquire);
+	}
+
+	inline void unlock() {
+		if (state.exchange(0, std::memory_order_release) == 2) wake();
+	}
+};
+
+
+// Counter that threads sleep on until it changes (a futex; short sleeps where there are none),
+// e.g. helpers waiting for work: they read it, look for work, then wait while it still has the value read.
+class WaitCounter {
+private:
+	std::atomic<int> value;
+public:
+	WaitCounter() : value(0) {}
+
+	inline int load() const {
+		return value.load(std::memory_order_acquire);
+	}
+
+	void waitWhile(int seen) {
+#ifdef __linux__
+		syscall(SYS_futex, (int*)&value, FUTEX_WAIT_PRIVATE, seen, nullptr, nullptr, 0);
+#else
+		if (load() == seen) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif
+	}
+
+	void advance() {	// wakes every waiting thread
+		value.fetch_add(1, std::memory_order_release);
+#ifdef __linux__
+		syscall(SYS_futex, (int*)&value, FUTEX_WAKE_PRIVATE, 0x7FFFFFFF, nullptr, nullptr, 0);
+#endif
+	}
+};
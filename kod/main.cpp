@@ -1,90 +1,139 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <assert.h>
-#include <iostream>
-#include "slab.h"
-#include "test.h"
-
-#define BLOCK_NUMBER (1000)
-#define THREAD_NUM (5)
-#define ITERATIONS (2000)
-
-#define shared_size (7)
-
-void construct(void *data) {
-	printf_s("Shared object constructed.\n");
-	memset(data, MASK, shared_size);
-}
-
-int check(void *data, size_t size) {
-	int ret = 1;
-	for (int i = 0; i < size; i++) {
-		if (((unsigned char *)data)[i] != MASK) {
-			ret = 0;
-		}
-	}
-
-	return ret;
-}
-
-struct objects_s {
-	kmem_cache_t *cache;
-	void *data;
-};
-
-int work(struct data_s data) {
-	char buffer[1024];
-	int size = 0;
-	sprintf_s(buffer, 1024, "thread cache %d", data.id);
-	kmem_cache_t *cache = kmem_cache_create(buffer, data.id, 0, 0);
-
-	struct objects_s *objs = (objects_s*) kmalloc(sizeof(struct objects_s) * data.iterations);
-
-	for (int i = 0; i < data.iterations; i++) {
-		if (i % 100 == 0) {
-			objs[size].data = kmem_cache_alloc(data.shared);
-			objs[size].cache = data.shared;
-			assert(check(objs[size].data, shared_size));
-		}
-		else {
-			objs[size].data = kmem_cache_alloc(cache);
-			objs[size].cache = cache;
-			memset(objs[size].data, MASK, data.id);
-		}
-		size++;
-	}
-
-	kmem_cache_info(cache);
-	kmem_cache_info(data.shared);
-	kmem_cache_error(cache);
-
-	for (int i = 0; i < size; i++) {
-		assert(check(objs[i].data, (cache == objs[i].cache) ? data.id : shared_size));
-		kmem_cache_free(objs[i].cache, objs[i].data);
-	}
-
-	kfree(objs);
-	kmem_cache_destroy(cache);
-	return 0;
-}
-
-
-void run_threads(int(*work)(struct data_s), void *data, int num);
-
-
-int main() {
-	void *space = malloc(BLOCK_SIZE * BLOCK_NUMBER);
-	kmem_init(space, BLOCK_NUMBER);
-	kmem_cache_t *shared = kmem_cache_create("shared object", shared_size, construct, NULL);
-
-	struct data_s data;
-	data.shared = shared;
-	data.iterations = ITERATIONS;
-	run_threads(work, &data, THREAD_NUM);
-
-	kmem_cache_destroy(shared);
-
-	free(space);
-	return 0;
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <iostream>
+#include "slab.h"
+#include "test.h"
+#include "benchmark.h"
+
+#define BLOCK_NUMBER (1000)
+#define THREAD_NUM (5)
+#define ITERATIONS (2000)
+#define ARENA_MB (512)	// with KMEM_ARENA_FLAGS, e.g. -DKMEM_ARENA_FLAGS=KMEM_ARENA_THP (0 for small pages)
+
+#define shared_size (7)
+
+void construct(void *data) {
+	printf_s("Shared object constructed.\n");
+	memset(data, MASK, shared_size);
+}
+
+int check(void *data, size_t size) {
+	int ret = 1;
+	for (int i = 0; i < size; i++) {
+		if (((unsigned char *)data)[i] != MASK) {
+			ret = 0;
+		}
+	}
+
+	return ret;
+}
+
+struct objects_s {
+	kmem_cache_t *cache;
+	void *data;
+};
+
+int work(struct data_s data) {
+	char buffer[1024];
+	int size = 0;
+	sprintf_s(buffer, 1024, "thread cache %d", data.id);
+	kmem_cache_t *cache = kmem_cache_create(buffer, data.id, 0, 0);
+
+	struct objects_s *objs = (objects_s*) kmalloc(sizeof(struct objects_s) * data.iterations);
+
+	for (int i = 0; i < data.iterations; i++) {
+		if (i % 100 == 0) {
+			objs[size].data = kmem_cache_alloc(data.shared);
+			objs[size].cache = data.shared;
+			assert(check(objs[size].data, shared_size));
+		}
+		else {
+			objs[size].data = kmem_cache_alloc(cache);
+			objs[size].cache = cache;
+			memset(objs[size].data, MASK, data.id);
+		}
+		size++;
+	}
+
+	kmem_cache_info(cache);
+	kmem_cache_info(data.shared);
+	kmem_cache_error(cache);
+
+	for (int i = 0; i < size; i++) {
+		assert(check(objs[i].data, (cache == objs[i].cache) ? data.id : shared_size));
+		kmem_cache_free(objs[i].cache, objs[i].data);
+	}
+
+	kfree(objs);
+	kmem_cache_destroy(cache);
+	return 0;
+}
+
+
+void run_threads(int(*work)(struct data_s), void *data, int num);
+
+
+int main() {
+#ifdef KMEM_ARENA_FLAGS
+	void *space = NULL;
+	if (kmem_init_arena((size_t)ARENA_MB << 20, KMEM_ARENA_FLAGS) < 0) return 1;
+#else
+	void *space = malloc(BLOCK_SIZE * BLOCK_NUMBER);
+	kmem_init(space, BLOCK_NUMBER);
+#endif
+	kmem_cache_t *shared = kmem_cache_create("shared object", shared_size, construct, NULL);
+
+	struct data_s data;
+	data.shared = shared;
+	data.iterations = ITERATIONS;
+	run_threads(work, &data, THREAD_NUM);
+
+	kmem_cache_destroy(shared);
+
+	int failed = 0;
+	failed += test_page_cache_exit();
+	failed += test_mempool();
+	failed += test_mempool_contended();
+	failed += test_lazy_buddies();
+	failed += test_double_free();
+	failed += test_aligned_alloc();
+	failed += test_tuning();
+	failed += test_merged_alias();
+	if (failed > 0) return 1;
+
+#ifdef RUN_STRESS	// fails when scaling falls below the baseline (stored by the first run)
+	if (benchmark_stress(8, 100000, "stress results.txt", "stress baseline.txt") != 0) return 1;
+#endif
+
+#ifdef RUN_BENCHMARKS
+	benchmark_pmr_containers(10000, 20);
+	benchmark_churn(64, 20000, 20);
+	benchmark_alloc_order(64, 40000, 20);
+	benchmark_alloc_order(256, 10000, 20);
+	benchmark_lifetimes(64, 20000, 16);
+	benchmark_lifetimes(512, 2000, 16);
+	benchmark_realloc(512 * 1024, 25, 50);
+	benchmark_compaction(64, 20000, 10);
+	benchmark_compaction(512, 2000, 25);
+	benchmark_slab_geometry();
+	benchmark_contended(64, 200000, 8);
+	benchmark_tuning(64, 4000, 8, 4);
+	benchmark_metrics(64, 1000000, 8, "kmem metrics.prom");
+	benchmark_coloring(7000, 128, 50);
+	benchmark_slab_cycles(4096, 4, 50000, 1);
+	benchmark_slab_cycles(4096, 4, 20000, 4);
+	benchmark_buddy_churn(64 * 1024, 4, 20000);
+	benchmark_buddy_churn(64 * 1024, 16, 5000);
+	benchmark_zalloc(64, 20000, 20);
+	benchmark_zalloc(1024, 2000, 20);
+	benchmark_async_construction(256, 2000, 200);
+#ifdef KMEM_ARENA_FLAGS
+	benchmark_huge_pages(64, 1 << 20, 8);
+#endif
+#endif
+
+	free(space);
+	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,148 @@
+// C allocation functions on top of the allocator, for LD_PRELOAD (Linux), enabled with KMEM_MALLOC_SHIM.
+// The space is mapped with mmap on the first call. Build all sources but main.cpp, test.cpp and
+// benchmark.cpp as a shared object, e.g.:
+//   g++ -std=c++17 -O2 -fPIC -shared -pthread -DKMEM_MALLOC_SHIM -DKMEM_REPLACE_NEW_DELETE
+//       allocator.cpp cache.cpp "construction pool.cpp" epoch.cpp "malloc shim.cpp" "memory ops.cpp"
+//       "memory resource.cpp" "mempool class.cpp" mempool.cpp metrics.cpp "new delete.cpp"
+//       "slab class.cpp" slab.cpp -o libkmem.so
+//   LD_PRELOAD=./libkmem.so <program>
+// KMEM_ARENA_MB limits the size of the space (default and maximum: 2^N - 1 blocks, reserved, not committed).
+// KMEM_HUGEPAGES=thp asks for transparent huge pages, KMEM_HUGEPAGES=hugetlb for reserved ones first.
+
+#ifdef KMEM_MALLOC_SHIM
+
+
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include "allocator.h"
+#include "memory ops.h"
+
+
+static std::atomic<int> init_state(0);	// 0 - not initialized, 1 - in progress, 2 - done, 3 - failed
+static std::atomic<pthread_t> init_thread;
+
+
+static bool lazy_init() {
+	int state = init_state.load(std::memory_order_acquire);
+	if (state == 2) return true;
+	if (state == 0 && init_state.compare_exchange_strong(state, 1, std::memory_order_acq_rel)) {
+		init_thread.store(pthread_self());
+		long blocks = (1L << N) - 1;
+		const char* env = getenv("KMEM_ARENA_MB");	// getenv does not allocate
+		if (env != nullptr && atol(env) > 0 && atol(env) * (1L << 20) / BLOCK_SIZE < blocks)
+			blocks = atol(env) * (1L << 20) / BLOCK_SIZE;
+		unsigned flags = 0;
+		if ((env = getenv("KMEM_HUGEPAGES")) != nullptr)
+			flags = strcmp(env, "hugetlb") == 0 ? KMEM_ARENA_HUGETLB : (strcmp(env, "thp") == 0 ? KMEM_ARENA_THP : 0);
+		unsigned backing = 0;
+		char* arena = (char*)map_arena((size_t)blocks * BLOCK_SIZE, flags, &backing);	// aligned to 2 MB
+		if (arena == nullptr) {
+			init_state.store(3, std::memory_order_release);
+			return false;
+		}
+		Allocator::init(arena, (int)blocks, true, backing != 0);	// Anonymous mappings are zero-filled.
+		init_state.store(2, std::memory_order_release);
+		return true;
+	}
+	if (state == 1 && pthread_equal(init_thread.load(), pthread_self())) return false;	// Reentered from the initialization.
+	while ((state = init_state.load(std::memory_order_acquire)) == 1) sched_yield();
+	return state == 2;
+}
+
+
+static void* aligned_malloc(size_t alignment, size_t size) {
+	if (!lazy_init()) return nullptr;
+	return Allocator::malloc_aligned(size ? size : 1, alignment);
+}
+
+
+
+extern "C" {
+
+
+void* malloc(size_t size) noexcept {
+	void* p = lazy_init() ? Allocator::malloc(size ? size : 1) : nullptr;
+	if (p == nullptr) errno = ENOMEM;
+	return p;
+}
+
+
+void free(void* p) noexcept {
+	if (p == nullptr || Allocator::block_index(p) < 0) return;	// Memory that does not come from the space is left alone.
+	Allocator::free(p);
+}
+
+
+void* calloc(size_t n, size_t size) noexcept {
+	if (size != 0 && n > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return nullptr;
+	}
+	size_t bytes = n * size;
+	void* p = lazy_init() ? Allocator::zmalloc(bytes != 0 ? bytes : 1) : nullptr;	// Untouched pages of the arena are not zeroed again.
+	if (p == nullptr) errno = ENOMEM;
+	return p;
+}
+
+
+void* realloc(void* p, size_t size) noexcept {
+	if (p == nullptr) return malloc(size);
+	if (Allocator::block_index(p) < 0) {
+		errno = ENOMEM;
+		return nullptr;
+	}
+	void* ret = Allocator::realloc(p, size);
+	if (ret == nullptr && size != 0) errno = ENOMEM;
+	return ret;
+}
+
+
+void* memalign(size_t alignment, size_t size) noexcept {
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+		errno = EINVAL;
+		return nullptr;
+	}
+	void* p = aligned_malloc(alignment, size);
+	if (p == nullptr) errno = ENOMEM;
+	return p;
+}
+
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) noexcept {
+	if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) return EINVAL;
+	void* p = aligned_malloc(alignment, size);
+	if (p == nullptr) return ENOMEM;
+	*memptr = p;
+	return 0;
+}
+
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept {
+	return memalign(alignment, size);
+}
+
+
+void* valloc(size_t size) noexcept {
+	return memalign(BLOCK_SIZE, size);
+}
+
+
+void* pvalloc(size_t size) noexcept {
+	return memalign(BLOCK_SIZE, (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE);
+}
+
+
+size_t malloc_usable_size(void* p) noexcept {
+	return p != nullptr ? Allocator::usable_size(p) : 0;
+}
+
+
+}
+
+
+#endif
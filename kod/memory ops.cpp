@@ -0,0 +1,229 @@
+#include "memory ops.h"
+#include "slab.h"
+#include <cstring>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define KMEM_SSE2
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/mman.h>
+#elif defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define KMEM_CPUID
+#endif
+
+
+
+#ifdef KMEM_SSE2
+
+static inline void store16(char* p) {
+	_mm_storeu_si128((__m128i*)p, _mm_setzero_si128());
+}
+
+
+static inline void zero_16_to_64(char* p, size_t n) {	// overlapping stores from both ends
+	store16(p);
+	store16(p + n - 16);
+	if (n > 32) {
+		store16(p + 16);
+		store16(p + n - 32);
+	}
+}
+
+
+static void zero_aligned_loop(char* p, size_t n) {	// n > 64
+	char* end = p + n;
+	store16(p);	// The unaligned head, then everything from the first aligned address.
+	char* q = (char*)(((uintptr_t)p + 16) & ~(uintptr_t)15);
+#ifdef __AVX2__
+	if (((uintptr_t)q & 31) != 0) {
+		_mm_store_si128((__m128i*)q, _mm_setzero_si128());
+		q += 16;
+	}
+	const __m256i z = _mm256_setzero_si256();
+	for (; q + 64 <= end; q += 64) {
+		_mm256_store_si256((__m256i*)q, z);
+		_mm256_store_si256((__m256i*)(q + 32), z);
+	}
+#else
+	const __m128i z = _mm_setzero_si128();
+	for (; q + 64 <= end; q += 64) {
+		_mm_store_si128((__m128i*)q, z);
+		_mm_store_si128((__m128i*)(q + 16), z);
+		_mm_store_si128((__m128i*)(q + 32), z);
+		_mm_store_si128((__m128i*)(q + 48), z);
+	}
+#endif
+	for (; q + 16 <= end; q += 16) _mm_store_si128((__m128i*)q, _mm_setzero_si128());
+	store16(end - 16);	// The tail.
+}
+
+#endif
+
+
+void zero_memory(void* p, size_t n) {
+#ifdef KMEM_SSE2
+	char* c = (char*)p;
+	if (n < 16) memset(p, 0, n);
+	else if (n <= 64) zero_16_to_64(c, n);
+	else if (n < ZERO_NONTEMPORAL_THRESHOLD) zero_aligned_loop(c, n);
+	else zero_memory_nontemporal(p, n);
+#else
+	memset(p, 0, n);
+#endif
+}
+
+
+void zero_memory_nontemporal(void* p, size_t n) {
+#ifdef KMEM_SSE2
+	char* c = (char*)p;
+	if (n <= 64) {
+		zero_memory(p, n);
+		return;
+	}
+	char* end = c + n;
+	store16(c);
+	char* q = (char*)(((uintptr_t)c + 16) & ~(uintptr_t)15);
+	const __m128i z = _mm_setzero_si128();
+	for (; q + 64 <= end; q += 64) {
+		_mm_stream_si128((__m128i*)q, z);
+		_mm_stream_si128((__m128i*)(q + 16), z);
+		_mm_stream_si128((__m128i*)(q + 32), z);
+		_mm_stream_si128((__m128i*)(q + 48), z);
+	}
+	for (; q + 16 <= end; q += 16) _mm_stream_si128((__m128i*)q, z);
+	_mm_sfence();	// Streaming stores are weakly ordered.
+	store16(end - 16);
+#else
+	memset(p, 0, n);
+#endif
+}
+
+
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define KMEM_CPUID
+static void cpuid(int leaf, int subleaf, unsigned r[4]) {
+	int regs[4];
+	__cpuidex(regs, leaf, subleaf);
+	for (int i = 0; i < 4; i++) r[i] = (unsigned)regs[i];
+}
+#elif defined(KMEM_CPUID)
+static void cpuid(int leaf, int subleaf, unsigned r[4]) {
+	__cpuid_count(leaf, subleaf, r[0], r[1], r[2], r[3]);
+}
+#endif
+
+
+#ifdef KMEM_CPUID
+// Reads the data and unified caches that leaf reports into g, false if it reports none.
+static bool read_cache_leaf(unsigned leaf, cache_geometry& g) {
+	unsigned r[4];
+	bool found = false;
+	for (int i = 0; i < 16; i++) {
+		cpuid(leaf, i, r);
+		unsigned type = r[0] & 0x1F;	// 0: no more caches, 2: instruction cache
+		if (type == 0) break;
+		if (type == 2) continue;
+		found = true;
+		int level = (r[0] >> 5) & 0x7;
+		size_t line = (r[1] & 0xFFF) + 1;
+		int ways = (int)((r[1] >> 22) & 0x3FF) + 1;
+		size_t size = ways * (((r[1] >> 12) & 0x3FF) + 1) * line * ((size_t)r[2] + 1);
+		if (level == 1) {
+			g.line_size = line;
+			g.l1_size = size;
+			g.l1_ways = ways;
+		}
+		else if (level == 2) {
+			g.l2_size = size;
+			g.l2_ways = ways;
+		}
+	}
+	return found;
+}
+#endif
+
+
+cache_geometry detect_cache_geometry() {
+	cache_geometry g = { 64, 32 * 1024, 8, 256 * 1024, 4 };
+#ifdef KMEM_CPUID
+	// Leaf 4 (deterministic cache parameters, Intel); AMD reports the same layout in leaf 0x8000001D
+	// and may have a leaf 4 that describes no cache at all.
+	unsigned r[4];
+	cpuid(0, 0, r);
+	unsigned max_leaf = r[0];
+	cpuid(0x80000000, 0, r);
+	unsigned max_ext_leaf = r[0];
+	bool found = max_leaf >= 4 && read_cache_leaf(4, g);
+	if (!found && max_ext_leaf >= 0x8000001D) read_cache_leaf(0x8000001D, g);
+#endif
+#if defined(__linux__) && defined(_SC_LEVEL1_DCACHE_LINESIZE)
+	long v;
+	if ((v = sysconf(_SC_LEVEL1_DCACHE_LINESIZE)) > 0) g.line_size = v;
+	if ((v = sysconf(_SC_LEVEL1_DCACHE_SIZE)) > 0) g.l1_size = v;
+	if ((v = sysconf(_SC_LEVEL1_DCACHE_ASSOC)) > 0) g.l1_ways = (int)v;
+	if ((v = sysconf(_SC_LEVEL2_CACHE_SIZE)) > 0) g.l2_size = v;
+	if ((v = sysconf(_SC_LEVEL2_CACHE_ASSOC)) > 0) g.l2_ways = (int)v;
+#endif
+	if (g.line_size == 0 || (g.line_size & (g.line_size - 1)) != 0) g.line_size = 64;	// (used as an alignment)
+	return g;
+}
+
+
+
+void* map_arena(size_t bytes, unsigned flags, unsigned* backing) {
+	bytes = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	*backing = 0;
+#if defined(__linux__)
+#ifdef MAP_HUGETLB
+	if (flags & KMEM_ARENA_HUGETLB) {	// Fails unless enough huge pages are reserved (vm.nr_hugepages); they are aligned.
+		void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			*backing = KMEM_ARENA_HUGETLB;
+			return p;
+		}
+	}
+#endif
+	// Reserved, not committed: pages are taken on first touch.
+	char* raw = (char*)mmap(nullptr, bytes + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (raw == (char*)MAP_FAILED) return nullptr;
+	char* arena = (char*)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+	if (arena != raw) munmap(raw, arena - raw);
+	if (raw + HUGE_PAGE_SIZE != arena) munmap(arena + bytes, raw + HUGE_PAGE_SIZE - arena);
+#ifdef MADV_HUGEPAGE
+	if ((flags & (KMEM_ARENA_HUGETLB | KMEM_ARENA_THP)) && madvise(arena, bytes, MADV_HUGEPAGE) == 0) *backing = KMEM_ARENA_THP;
+#endif
+	return arena;
+#elif defined(_WIN32)
+	if (flags & KMEM_ARENA_HUGETLB) {	// Needs the "Lock pages in memory" privilege; committed at once.
+		size_t large = GetLargePageMinimum();
+		if (large > 0) {
+			void* p = VirtualAlloc(nullptr, (bytes + large - 1) / large * large, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (p != nullptr) {
+				*backing = KMEM_ARENA_HUGETLB;
+				return p;
+			}
+		}
+	}
+	// No transparent huge pages on Windows; the slack before the aligned start stays reserved.
+	char* raw = (char*)VirtualAlloc(nullptr, bytes + HUGE_PAGE_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (raw == nullptr) return nullptr;
+	return (void*)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+#else
+	(void)flags;
+	return nullptr;
+#endif
+}
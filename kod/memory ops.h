@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+
+#define ZERO_NONTEMPORAL_THRESHOLD (256 * 1024)	// larger buffers are zeroed around the cache (they would only evict it)
+
+
+// Zeroing kernels, specialized by size: small sizes use a few overlapping vector stores,
+// medium ones an aligned vector loop, large ones non-temporal (streaming) stores.
+// Without SSE2 they fall back to memset.
+void zero_memory(void* p, size_t n);
+void zero_memory_nontemporal(void* p, size_t n);	// e.g. for whole fresh slabs that will not be read soon
+
+
+// Prefetch the line at p into all cache levels, for writing if the compiler can tell the CPU (PREFETCHW).
+inline void prefetch_for_write(const void* p) {
+#if defined(__GNUC__) || defined(__clang__)
+	__builtin_prefetch(p, 1, 3);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	_m_prefetchw(p);
+#else
+	(void)p;
+#endif
+}
+
+
+// Data cache geometry of the CPU, from sysconf on Linux and cpuid elsewhere on x86.
+// Values that cannot be found keep the defaults (64 B lines, 32 KB 8-way L1, 256 KB 4-way L2).
+struct cache_geometry {
+	size_t line_size;
+	size_t l1_size;
+	int l1_ways;
+	size_t l2_size;
+	int l2_ways;
+};
+
+cache_geometry detect_cache_geometry();
+
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)	// x86-64 (and most 64-bit ARM) huge pages
+
+// Maps bytes (rounded up to HUGE_PAGE_SIZE) of zero-filled memory aligned to HUGE_PAGE_SIZE.
+// flags (KMEM_ARENA_*): KMEM_ARENA_HUGETLB tries reserved huge pages first (Linux MAP_HUGETLB,
+// Windows large pages), otherwise KMEM_ARENA_HUGETLB and KMEM_ARENA_THP ask for transparent ones.
+// *backing is set to the kind of pages obtained (0 for small pages); returns nullptr on failure.
+void* map_arena(size_t bytes, unsigned flags, unsigned* backing);
@@ -0,0 +1,27 @@
+#include "memory resource.h"
+
+
+
+void* KmemResource::do_allocate(size_t bytes, size_t alignment) {
+	if (bytes == 0) bytes = 1;	// Every allocation must return a distinct pointer.
+	void* p = Allocator::malloc_aligned(bytes, alignment);
+	if (p == nullptr) throw std::bad_alloc();
+	return p;
+}
+
+
+void KmemResource::do_deallocate(void* p, size_t bytes, size_t alignment) {
+	if (bytes == 0) bytes = 1;
+	Allocator::free_sized(p, bytes, alignment);
+}
+
+
+bool KmemResource::do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+	return dynamic_cast<const KmemResource*>(&other) != nullptr;	// All instances share the same allocator.
+}
+
+
+std::pmr::memory_resource* kmem_resource() {
+	static KmemResource resource;
+	return &resource;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+
+#include <memory_resource>
+#include <cstddef>
+#include <new>
+#include "allocator.h"
+
+
+// std::pmr::memory_resource backed by the size-N caches and the large buffer path.
+// Containers pass the size of every buffer they return, so deallocation goes
+// straight to the owning cache (see Allocator::free_sized()).
+class KmemResource : public std::pmr::memory_resource {
+protected:
+	void* do_allocate(size_t bytes, size_t alignment) override;
+	void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+};
+
+
+std::pmr::memory_resource* kmem_resource();	// Returns the (only) KmemResource object.
+
+
+
+// Allocator that satisfies the standard Allocator requirements, for containers
+// that do not use polymorphic allocators.
+template <class T>
+class KmemAllocator {
+public:
+	typedef T value_type;
+
+	KmemAllocator() noexcept {}
+
+	template <class U>
+	KmemAllocator(const KmemAllocator<U>&) noexcept {}
+
+	T* allocate(size_t n) {
+		if (n > (size_t)-1 / sizeof(T)) throw std::bad_array_new_length();
+		return (T*)kmem_resource()->allocate(n * sizeof(T), alignof(T));
+	}
+
+	void deallocate(T* p, size_t n) noexcept {
+		kmem_resource()->deallocate(p, n * sizeof(T), alignof(T));
+	}
+};
+
+
+template <class T, class U>
+inline bool operator==(const KmemAllocator<T>&, const KmemAllocator<U>&) noexcept {
+	return true;
+}
+
+template <class T, class U>
+inline bool operator!=(const KmemAllocator<T>&, const KmemAllocator<U>&) noexcept {
+	return false;
+}
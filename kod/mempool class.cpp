@@ -0,0 +1,107 @@
+#include "mempool class.h"
+#include "allocator.h"
+#include <new>
+#include <chrono>
+
+
+
+Mempool* Mempool::createMempool(int min_nr, kmem_cache_t* cachep) {
+	if (min_nr <= 0 || cachep == nullptr) return nullptr;	// error
+	void** reserve = (void**)Allocator::malloc(min_nr * sizeof(void*));
+	if (reserve == nullptr) return nullptr;	// error
+	int n = 0;
+	for (; n < min_nr; n++) {
+		reserve[n] = cachep->alloc();
+		if (reserve[n] == nullptr) break;
+	}
+	void* loc = n == min_nr ? Allocator::malloc(sizeof(Mempool)) : nullptr;
+	if (loc == nullptr) {	// error, give back what has been reserved
+		while (n > 0) cachep->free(reserve[--n]);
+		Allocator::free_sized(reserve, min_nr * sizeof(void*));
+		return nullptr;
+	}
+	return new (loc) Mempool(min_nr, cachep, reserve);	// Placement new!
+}
+
+
+Mempool::Mempool(int min_nr, kmem_cache_t* cachep, void** reserve) {
+	this->cache = cachep;
+	this->reserve = reserve;
+	this->min_nr = min_nr;
+	this->curr_nr = min_nr;
+	this->stopping = false;
+	refiller = std::thread(&Mempool::refill, this);
+}
+
+
+void* Mempool::alloc(int flags) {
+	void* ret = cache->alloc(false);	// Never waits for a new slab (threads that create one do not hold the cache meanwhile).
+	if (ret != nullptr) return ret;
+
+	std::unique_lock<std::mutex> lock(m);
+	for (;;) {
+		if (curr_nr > 0) {
+			ret = reserve[--curr_nr];
+			lock.unlock();
+			refillNeeded.notify_one();
+			return ret;
+		}
+		if (!(flags & MEMPOOL_WAIT)) return nullptr;	// The cache and the reserve are exhausted.
+		objectAvailable.wait(lock);
+	}
+}
+
+
+void Mempool::free(void* objp) {
+	if (objp == nullptr) return;
+	std::unique_lock<std::mutex> lock(m);
+	if (curr_nr < min_nr) {
+		reserve[curr_nr++] = objp;
+		lock.unlock();
+		objectAvailable.notify_one();
+		return;
+	}
+	lock.unlock();
+	cache->free(objp);
+}
+
+
+void Mempool::refill() {
+	std::unique_lock<std::mutex> lock(m);
+	while (!stopping) {
+		if (curr_nr == min_nr) {
+			refillNeeded.wait(lock);
+			continue;
+		}
+		lock.unlock();
+		void* objp = cache->alloc();
+		lock.lock();
+		if (objp == nullptr) {	// No memory at the moment; try again later.
+			refillNeeded.wait_for(lock, std::chrono::milliseconds(1));
+			continue;
+		}
+		if (curr_nr < min_nr) {
+			reserve[curr_nr++] = objp;
+			objectAvailable.notify_one();
+		}
+		else {
+			lock.unlock();
+			cache->free(objp);
+			lock.lock();
+		}
+	}
+}
+
+
+void Mempool::destroy() {
+	{
+		std::lock_guard<std::mutex> lock(m);
+		stopping = true;
+	}
+	refillNeeded.notify_one();
+	refiller.join();
+	for (int i = 0; i < curr_nr; i++) cache->free(reserve[i]);
+	Allocator::free_sized(reserve, min_nr * sizeof(void*));
+	this->~Mempool();
+	Allocator::free_sized(this, sizeof(Mempool));
+}
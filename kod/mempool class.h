@@ -0,0 +1,43 @@
+#pragma once
+
+
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "mempool.h"
+#include "cache.h"
+
+
+
+// Reserve of min_nr objects of a cache, in the spirit of Linux mempool_t.
+// Allocation uses only the slabs the cache already has; if they are full, an object
+// is taken from the reserve and a background thread refills it (the refilling thread
+// is the only one that waits for new slabs). Freed objects refill the reserve first.
+class Mempool {
+private:
+	kmem_cache_t* cache;
+	void** reserve;
+	int min_nr;
+	int curr_nr;
+
+	std::mutex m;
+	std::condition_variable objectAvailable;	// blocking allocations wait for it
+	std::condition_variable refillNeeded;
+	std::thread refiller;
+	bool stopping;
+
+	Mempool(int min_nr, kmem_cache_t* cachep, void** reserve);
+
+	void refill();	// body of the refilling thread
+public:
+	static Mempool* createMempool(int min_nr, kmem_cache_t* cachep);
+
+	void* alloc(int flags);
+	void free(void* objp);
+	void destroy();
+
+	inline int getReserved() const {
+		return curr_nr;
+	}
+};
+
@@ -0,0 +1,21 @@
+#include "mempool.h"
+#include "mempool class.h"
+
+
+// mempool_t is an opaque handle for a Mempool object.
+
+mempool_t *mempool_create(int min_nr, kmem_cache_t *cachep) {
+	return (mempool_t*)Mempool::createMempool(min_nr, cachep);
+}
+
+void *mempool_alloc(mempool_t *pool, int flags) {
+	return ((Mempool*)pool)->alloc(flags);
+}
+
+void mempool_free(mempool_t *pool, void *objp) {
+	((Mempool*)pool)->free(objp);
+}
+
+void mempool_destroy(mempool_t *pool) {
+	((Mempool*)pool)->destroy();
+}
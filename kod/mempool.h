@@ -0,0 +1,16 @@
+#pragma once
+
+// File: mempool.h
+// Pools that keep a reserve of objects of a cache, for paths that must not fail.
+#include "slab.h"
+
+typedef struct mempool_s mempool_t;
+
+#define MEMPOOL_NOWAIT (0) // Return NULL when the cache and the reserve are exhausted
+#define MEMPOOL_WAIT (1) // Wait until an object is freed back to the pool instead
+
+
+mempool_t *mempool_create(int min_nr, kmem_cache_t *cachep); // Reserve min_nr objects of the cache
+void *mempool_alloc(mempool_t *pool, int flags); // Allocate one object, from the reserve if the cache cannot provide it immediately
+void mempool_free(mempool_t *pool, void *objp); // Deallocate one object (it refills the reserve first)
+void mempool_destroy(mempool_t *pool); // Give the reserve back to the cache and deallocate pool
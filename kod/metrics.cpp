@@ -0,0 +1,324 @@
+#include "metrics.h"
+#include "allocator.h"
+#include "cache.h"
+#include <new>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <system_error>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+
+std::atomic<ThreadMetrics*> Metrics::records(nullptr);
+ThreadMetrics Metrics::staticRecords[METRICS_STATIC_RECORDS];
+std::atomic<int> Metrics::staticRecordsUsed(0);
+long long Metrics::base[METRICS_SLOTS][METRIC_KINDS] = { { 0 } };
+bool Metrics::taken[METRICS_SLOTS] = { false };
+AdaptiveMutex Metrics::slotsMutex;
+std::atomic<int> Metrics::generation(0);
+
+static thread_local ThreadMetrics* thread_metrics = nullptr;	// POD, see Allocator's page cache
+
+// The record is freed for the next thread when the thread finishes. Threads count from their first
+// allocation, which may come from the dynamic loader (see malloc shim.cpp), where registering a
+// thread_local destructor deadlocks; a pthread key needs neither malloc nor the loader's lock.
+#ifdef __linux__
+static pthread_key_t metrics_exit_key;
+static pthread_once_t metrics_exit_once = PTHREAD_ONCE_INIT;
+
+static void watch_thread_exit(ThreadMetrics* r) {
+	pthread_once(&metrics_exit_once, []() { pthread_key_create(&metrics_exit_key, [](void*) { Metrics::threadExit(); }); });
+	pthread_setspecific(metrics_exit_key, r);
+}
+#else
+struct MetricsThreadExit {
+	~MetricsThreadExit() {
+		Metrics::threadExit();
+	}
+};
+static thread_local MetricsThreadExit metrics_thread_exit;
+
+static void watch_thread_exit(ThreadMetrics*) {
+	(void)&metrics_thread_exit;	// The destructor runs only for threads that have touched it.
+}
+#endif
+
+
+ThreadMetrics* Metrics::self() {
+	if (thread_metrics != nullptr) return thread_metrics;
+	if (!Allocator::initialized()) return nullptr;
+	ThreadMetrics* r = nullptr;
+	for (ThreadMetrics* cur = records.load(); cur != nullptr && r == nullptr; cur = cur->next) {
+		bool expected = false;
+		if (!cur->inUse.load() && cur->inUse.compare_exchange_strong(expected, true)) r = cur;
+	}
+	if (r == nullptr) {
+		// The main thread's record is written by its thread_local destructor, which may run after the
+		// space has been given back (at exit), so the first records are static. Others come straight
+		// from the buddy allocator: a cache would count its own allocation.
+		int i = staticRecordsUsed.fetch_add(1);
+		if (i < METRICS_STATIC_RECORDS) r = &staticRecords[i];	// (zero-initialized)
+		else {
+			void* loc = Allocator::buddy_alloc_space_required(sizeof(ThreadMetrics));
+			if (loc == nullptr) return nullptr;	// error
+			r = new (loc) ThreadMetrics();	// Placement new!
+			for (int i = 0; i < METRICS_SLOTS; i++)
+				for (int k = 0; k < METRIC_KINDS; k++) r->counts[i][k].store(0, std::memory_order_relaxed);
+		}
+		r->inUse.store(true);
+		r->next = records.load();
+		while (!records.compare_exchange_weak(r->next, r));
+	}
+	thread_metrics = r;	// before watch_thread_exit, which may allocate, and so count
+	watch_thread_exit(r);
+	return r;
+}
+
+
+void Metrics::threadExit() {
+	if (thread_metrics == nullptr) return;
+	thread_metrics->inUse.store(false);
+	thread_metrics = nullptr;
+}
+
+
+void Metrics::count(int slot, int kind, long long n) {
+	if (slot < 0) return;
+	ThreadMetrics* r = thread_metrics != nullptr ? thread_metrics : self();
+	if (r == nullptr) return;
+	std::atomic<long long>& c = r->counts[slot][kind];
+	c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);	// (only this thread writes it)
+}
+
+
+long long Metrics::sum(int slot, int kind) {
+	long long s = 0;
+	for (ThreadMetrics* r = records.load(); r != nullptr; r = r->next) s += r->counts[slot][kind].load(std::memory_order_relaxed);
+	return s;
+}
+
+
+long long Metrics::read(int slot, int kind) {
+	return slot < 0 ? 0 : sum(slot, kind) - base[slot][kind];
+}
+
+
+int Metrics::acquireSlot() {
+	std::lock_guard<AdaptiveMutex> guard(slotsMutex);
+	for (int i = 0; i < METRICS_SLOTS; i++) {
+		if (taken[i]) continue;
+		taken[i] = true;
+		for (int k = 0; k < METRIC_KINDS; k++) base[i][k] = sum(i, k);	// Nobody counts in a free slot.
+		return i;
+	}
+	return -1;
+}
+
+
+void Metrics::releaseSlot(int slot) {
+	if (slot < 0) return;
+	std::lock_guard<AdaptiveMutex> guard(slotsMutex);
+	taken[slot] = false;
+}
+
+
+
+struct CacheSample {
+	std::string name;	// escaped for a label value
+	bool counted;
+	long long allocs, frees, failures;
+	int slabs;
+	long long blocks;
+	size_t slotSize;
+};
+
+
+static std::string label_value(const char* s) {
+	std::string ret;
+	for (; *s; s++) {
+		if (*s == '\\' || *s == '"') ret += '\\';
+		if (*s == '\n') ret += "\\n";
+		else ret += *s;
+	}
+	return ret;
+}
+
+
+static void family(std::string& s, const char* name, const char* type, const char* help) {
+	s += "# HELP "; s += name; s += ' '; s += help; s += '\n';
+	s += "# TYPE "; s += name; s += ' '; s += type; s += '\n';
+}
+
+
+static void sample(std::string& s, const char* name, const char* label, const std::string& value, long long v) {
+	s += name;
+	if (label != nullptr) { s += '{'; s += label; s += "=\""; s += value; s += "\"}"; }
+	s += ' '; s += std::to_string(v); s += '\n';
+}
+
+
+std::string Metrics::text() {
+	std::vector<CacheSample> caches;
+	Allocator::for_each_cache([](Cache* c, void* arg) {
+		CacheSample cs;
+		cs.name = label_value(c->getName());
+		int slot = c->getMetricsSlot();
+		cs.counted = slot >= 0;
+		cs.allocs = read(slot, METRIC_ALLOCS);
+		cs.frees = read(slot, METRIC_FREES);
+		cs.failures = read(slot, METRIC_FAILURES);
+		cs.slabs = c->getNumOfSlabs();
+		cs.blocks = c->getNumOfBlocks();
+		cs.slotSize = c->getSlotSize();
+		((std::vector<CacheSample>*)arg)->push_back(cs);
+	}, &caches);
+
+	std::string s;
+	struct Counter { const char* name; const char* help; long long CacheSample::* field; };
+	const Counter counters[] = {
+		{ "kmem_cache_allocs_total", "Objects allocated from the cache.", &CacheSample::allocs },
+		{ "kmem_cache_frees_total", "Objects freed to the cache.", &CacheSample::frees },
+		{ "kmem_cache_failures_total", "Allocations without memory and frees of objects the cache does not own.", &CacheSample::failures },
+	};
+	for (const Counter& k : counters) {
+		family(s, k.name, "counter", k.help);
+		for (const CacheSample& c : caches)
+			if (c.counted) sample(s, k.name, "cache", c.name, c.*k.field);
+	}
+	family(s, "kmem_cache_objects", "gauge", "Objects in use.");
+	for (const CacheSample& c : caches)
+		if (c.counted) sample(s, "kmem_cache_objects", "cache", c.name, c.allocs - c.frees);
+	family(s, "kmem_cache_object_size_bytes", "gauge", "Size of one object slot.");
+	for (const CacheSample& c : caches) sample(s, "kmem_cache_object_size_bytes", "cache", c.name, (long long)c.slotSize);
+	family(s, "kmem_cache_slabs", "gauge", "Slabs of the cache.");
+	for (const CacheSample& c : caches) sample(s, "kmem_cache_slabs", "cache", c.name, c.slabs);
+	family(s, "kmem_cache_slab_bytes", "gauge", "Memory taken by the slabs of the cache.");
+	for (const CacheSample& c : caches) sample(s, "kmem_cache_slab_bytes", "cache", c.name, c.blocks * BLOCK_SIZE);
+	family(s, "kmem_cache_used_bytes", "gauge", "Memory of the slabs that holds objects in use.");
+	for (const CacheSample& c : caches)
+		if (c.counted) sample(s, "kmem_cache_used_bytes", "cache", c.name, (c.allocs - c.frees) * (long long)c.slotSize);
+	family(s, "kmem_cache_wasted_bytes", "gauge", "Memory of the slabs that holds no object in use (free slots, colors, descriptors, leftovers).");
+	for (const CacheSample& c : caches)
+		if (c.counted) sample(s, "kmem_cache_wasted_bytes", "cache", c.name, c.blocks * BLOCK_SIZE - (c.allocs - c.frees) * (long long)c.slotSize);
+
+	int chunks[N], lazy;
+	long long freeBlocks = Allocator::buddy_free_chunks(chunks, &lazy);
+	long long splits, merges;
+	Allocator::buddy_counts(&splits, &merges);
+	family(s, "kmem_buddy_bytes", "gauge", "Memory managed by the buddy allocator.");
+	sample(s, "kmem_buddy_bytes", nullptr, "", (long long)Allocator::blocks() * BLOCK_SIZE);
+	family(s, "kmem_buddy_free_bytes", "gauge", "Memory in the buddy lists (runs kept by threads for reuse are not included).");
+	sample(s, "kmem_buddy_free_bytes", nullptr, "", freeBlocks * BLOCK_SIZE);
+	family(s, "kmem_buddy_free_chunks", "gauge", "Free chunks of 2^order blocks.");
+	for (int i = 0; i < N; i++) sample(s, "kmem_buddy_free_chunks", "order", std::to_string(i), chunks[i]);
+	family(s, "kmem_buddy_lazy_chunks", "gauge", "Free chunks kept apart from their free buddies (lazy coalescing).");
+	sample(s, "kmem_buddy_lazy_chunks", nullptr, "", lazy);
+	family(s, "kmem_buddy_splits_total", "counter", "Chunks divided in halves.");
+	sample(s, "kmem_buddy_splits_total", nullptr, "", splits);
+	family(s, "kmem_buddy_merges_total", "counter", "Buddies joined.");
+	sample(s, "kmem_buddy_merges_total", nullptr, "", merges);
+	int slot = Allocator::large_metrics_slot();
+	family(s, "kmem_large_allocs_total", "counter", "Buffers larger than the size-N caches, allocated from the buddy allocator.");
+	sample(s, "kmem_large_allocs_total", nullptr, "", read(slot, METRIC_ALLOCS));
+	family(s, "kmem_large_frees_total", "counter", "Large buffers freed.");
+	sample(s, "kmem_large_frees_total", nullptr, "", read(slot, METRIC_FREES));
+	family(s, "kmem_large_failures_total", "counter", "Large allocations without memory and frees of pointers that are not large buffers.");
+	sample(s, "kmem_large_failures_total", nullptr, "", read(slot, METRIC_FAILURES));
+	return s;
+}
+
+
+int Metrics::write(const char* path) {
+	std::string s = text();
+	std::string tmp = std::string(path) + ".tmp";
+	FILE* f = fopen(tmp.c_str(), "w");
+	if (f == nullptr) return -1;
+	bool ok = fwrite(s.data(), 1, s.size(), f) == s.size();
+	ok = fclose(f) == 0 && ok;
+	if (!ok || rename(tmp.c_str(), path) != 0) {	// (rename replaces path atomically on POSIX)
+		remove(tmp.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+
+void Metrics::exportLoop(int gen, int intervalMs, int listener, std::string target) {
+	while (generation.load() == gen) {
+		if (listener < 0) {
+			write(target.c_str());
+			std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs));
+			continue;
+		}
+#ifdef __linux__
+		pollfd p = { listener, POLLIN, 0 };
+		if (poll(&p, 1, intervalMs) <= 0 || generation.load() != gen) continue;
+		int client = accept(listener, nullptr, nullptr);
+		if (client < 0) continue;
+		std::string s = text();	// One export per connection, then the client sees the end of the stream.
+		for (size_t done = 0; done < s.size();) {
+			ssize_t n = send(client, s.data() + done, s.size() - done, MSG_NOSIGNAL);
+			if (n <= 0) break;
+			done += (size_t)n;
+		}
+		close(client);
+#endif
+	}
+#ifdef __linux__
+	if (listener >= 0) {
+		close(listener);
+		unlink(target.c_str());
+	}
+#endif
+}
+
+
+int Metrics::start(const char* path, int intervalMs) {
+	if (path == nullptr || intervalMs <= 0) return -1;
+	int gen = ++generation;	// The previous exporter finishes.
+	int listener = -1;
+	std::string target = path;
+	if (strncmp(path, "unix:", 5) == 0) {
+		target = path + 5;
+#ifdef __linux__
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (target.size() >= sizeof(addr.sun_path)) return -1;
+		memcpy(addr.sun_path, target.c_str(), target.size());
+		listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener < 0) return -1;
+		unlink(target.c_str());	// (left by an earlier process)
+		if (bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 8) != 0) {
+			close(listener);
+			return -1;
+		}
+#else
+		return -1;	// Unix-domain sockets are only served on Linux.
+#endif
+	}
+	try {
+		std::thread(exportLoop, gen, intervalMs, listener, target).detach();
+	}
+	catch (const std::system_error&) {
+#ifdef __linux__
+		if (listener >= 0) close(listener);
+#endif
+		return -1;
+	}
+	return 0;
+}
+
+
+void Metrics::stop() {
+	++generation;
+}
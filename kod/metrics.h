@@ -0,0 +1,62 @@
+#pragma once
+
+
+#include <atomic>
+#include <string>
+#include "slab.h"
+#include "lock.h"
+
+
+#ifndef METRICS_SLOTS
+#define METRICS_SLOTS (512)	// caches and handles counted at one time; further ones are not counted
+#endif
+
+#define METRICS_STATIC_RECORDS (8)	// records of the first threads are not in the allocator's space (see Metrics::self)
+
+#define METRIC_ALLOCS (0)
+#define METRIC_FREES (1)
+#define METRIC_FAILURES (2)
+#define METRIC_KINDS (3)
+
+
+// Counters of one thread. Only the owner writes them (a plain load and store, no locked instruction),
+// so counting causes no cache line traffic between cores; exports add up the records of all threads.
+// Records of finished threads are reused and keep their counts.
+struct alignas(CACHE_L1_LINE_SIZE) ThreadMetrics {
+	std::atomic<long long> counts[METRICS_SLOTS][METRIC_KINDS];
+	std::atomic<bool> inUse;
+	ThreadMetrics* next;
+};
+
+
+// Allocation counters and a Prometheus text-format exporter. Every registered cache and every handle
+// takes a slot; the sums of a slot when it is taken are kept in base, so a reused slot starts at zero.
+// The exporter writes counters of all caches (those of merged handles included) and gauges of the
+// caches and the buddy allocator, either to a file (through a temporary one that is renamed, so
+// readers never see a partial export) or to every client of a Unix-domain socket.
+class Metrics {
+private:
+	static std::atomic<ThreadMetrics*> records;	// records are only added to the list, never removed
+	static ThreadMetrics staticRecords[METRICS_STATIC_RECORDS];
+	static std::atomic<int> staticRecordsUsed;
+	static long long base[METRICS_SLOTS][METRIC_KINDS];
+	static bool taken[METRICS_SLOTS];
+	static AdaptiveMutex slotsMutex;
+
+	static std::atomic<int> generation;	// of the exporter thread; stop() and start() make the running one finish
+
+	static ThreadMetrics* self();	// record of the calling thread, nullptr if there is no memory for one
+	static long long sum(int slot, int kind);	// over all records
+	static void exportLoop(int gen, int intervalMs, int listener, std::string target);	// listener: socket, -1 to write target
+public:
+	static int acquireSlot();	// -1 if all slots are taken
+	static void releaseSlot(int slot);
+	static void count(int slot, int kind, long long n = 1);	// slot -1 is not counted
+	static long long read(int slot, int kind);	// since the slot was taken
+	static void threadExit();
+
+	static std::string text();	// all metrics in the Prometheus text format
+	static int write(const char* path);	// -1 if the file cannot be written
+	static int start(const char* path, int intervalMs);	// "unix:<path>" serves a socket instead of writing a file; -1 on error
+	static void stop();	// the exporter finishes within one interval
+};
@@ -0,0 +1,158 @@
+#include <new>
+#include <cstdlib>
+#include "slab.h"
+#include "allocator.h"
+
+
+// Global operator new/delete on top of kmalloc/kfree, enabled with KMEM_REPLACE_NEW_DELETE.
+// Sized delete (C++14) frees through kfree_sized(), so no cache has to be searched.
+// Memory requested before kmem_init(), or when the allocator is out of space,
+// comes from the C runtime and is returned to it.
+
+#ifdef KMEM_REPLACE_NEW_DELETE
+
+
+static void* kmem_new_nothrow(size_t size) noexcept {
+	if (size == 0) size = 1;
+	void* p = Allocator::initialized() ? kmalloc(size) : nullptr;
+	if (p == nullptr) p = std::malloc(size);
+	return p;
+}
+
+
+static void* kmem_new(size_t size) {
+	void* p = kmem_new_nothrow(size);
+	if (p == nullptr) throw std::bad_alloc();
+	return p;
+}
+
+
+static void* kmem_new_aligned_nothrow(size_t size, std::align_val_t alignment) noexcept {
+	if (size == 0) size = 1;
+	void* p = Allocator::initialized() ? Allocator::malloc_aligned(size, (size_t)alignment) : nullptr;
+	if (p != nullptr) return p;
+#ifdef _MSC_VER
+	return _aligned_malloc(size, (size_t)alignment);
+#else
+	return posix_memalign(&p, (size_t)alignment, size) == 0 ? p : nullptr;
+#endif
+}
+
+
+static void* kmem_new_aligned(size_t size, std::align_val_t alignment) {
+	void* p = kmem_new_aligned_nothrow(size, alignment);
+	if (p == nullptr) throw std::bad_alloc();
+	return p;
+}
+
+
+static void kmem_delete(void* p) noexcept {
+	if (p == nullptr) return;
+	if (Allocator::block_index(p) >= 0) kfree(p);
+	else std::free(p);
+}
+
+
+static void kmem_delete_sized(void* p, size_t size) noexcept {
+	if (p == nullptr) return;
+	if (Allocator::block_index(p) >= 0) kfree_sized(p, size ? size : 1);
+	else std::free(p);
+}
+
+
+static void kmem_delete_aligned(void* p, size_t size, std::align_val_t alignment) noexcept {	// size 0 if unknown
+	if (p == nullptr) return;
+	if (Allocator::block_index(p) >= 0) {
+		if (size) Allocator::free_sized(p, size, (size_t)alignment);
+		else kfree(p);	// Inner pointers of padded buffers are freed correctly too.
+	}
+#ifdef _MSC_VER
+	else _aligned_free(p);
+#else
+	else std::free(p);
+#endif
+}
+
+
+void* operator new(size_t size) {
+	return kmem_new(size);
+}
+
+void* operator new[](size_t size) {
+	return kmem_new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+	return kmem_new_nothrow(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+	return kmem_new_nothrow(size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+	return kmem_new_aligned(size, alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+	return kmem_new_aligned(size, alignment);
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+	return kmem_new_aligned_nothrow(size, alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+	return kmem_new_aligned_nothrow(size, alignment);
+}
+
+void operator delete(void* p) noexcept {
+	kmem_delete(p);
+}
+
+void operator delete[](void* p) noexcept {
+	kmem_delete(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+	kmem_delete(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+	kmem_delete(p);
+}
+
+void operator delete(void* p, size_t size) noexcept {
+	kmem_delete_sized(p, size);
+}
+
+void operator delete[](void* p, size_t size) noexcept {
+	kmem_delete_sized(p, size);
+}
+
+void operator delete(void* p, std::align_val_t alignment) noexcept {
+	kmem_delete_aligned(p, 0, alignment);
+}
+
+void operator delete[](void* p, std::align_val_t alignment) noexcept {
+	kmem_delete_aligned(p, 0, alignment);
+}
+
+void operator delete(void* p, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+	kmem_delete_aligned(p, 0, alignment);
+}
+
+void operator delete[](void* p, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+	kmem_delete_aligned(p, 0, alignment);
+}
+
+void operator delete(void* p, size_t size, std::align_val_t alignment) noexcept {
+	kmem_delete_aligned(p, size, alignment);
+}
+
+void operator delete[](void* p, size_t size, std::align_val_t alignment) noexcept {
+	kmem_delete_aligned(p, size, alignment);
+}
+
+
+#endif
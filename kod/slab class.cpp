@@ -1,143 +1,285 @@
-#include "slab class.h"
-#include "allocator.h"
-#include "slab.h"
-#include <new>
-
-
-Slab* Slab::createSlab(int numOfSlots, size_t slotSize, void (*constructor)(void *), int offset) {
-	size_t space_req = numOfSlots * (slotSize + sizeof(bufctl)) + sizeof(Slab);
-	void* space = Allocator::buddy_alloc_space_required(space_req);
-	if (space == nullptr) return nullptr;	// error
-	Slab* s = new (space) Slab(numOfSlots, slotSize, space, constructor, offset);	// Placement new!
-	return s;
-}
-
-
-int Slab::optimalNumOfSlotsPerSlab(size_t slotSize) {
-	int optimal_num_of_slots = 0;
-	float max_ratio = 0;
-	for (int i = 0, blocks = 1; i < N; i++) {
-		int bytes_available = blocks * BLOCK_SIZE;
-		int slots = (bytes_available - sizeof(Slab)) / (slotSize + sizeof(bufctl));
-		int bytes_remaining = bytes_available - slots * (slotSize + sizeof(bufctl)) - sizeof(Slab);
-		float ratio = (float)bytes_available / bytes_remaining;
-		if (ratio >= 8.) return slots;	// if 1/8 or less of available space is wasted, it is immediately accepted
-		if (ratio > max_ratio) {
-			max_ratio = ratio;
-			optimal_num_of_slots = slots;
-		}
-		if (i >= MAX_N_OPTIMAL && slots > 0) return optimal_num_of_slots;	// prevents too large numbers of blocks from being taken
-		blocks *= 2;
-	}
-	return optimal_num_of_slots;
-}
-
-
-int Slab::minimalNumOfSlotsPerSlab(size_t slotSize) {
-	for (int i = 0, blocks = 1; i < N; i++) {
-		int slots = (blocks * BLOCK_SIZE - sizeof(Slab)) / (slotSize + sizeof(bufctl));
-		if (slots > 0) return slots;
-		blocks *= 2;
-	}
-	return -1;	// error
-}
-
-
-int Slab::unusedSpaceWithOptimalSlots(size_t slotSize) {
-	int bytes_required = optimalNumOfSlotsPerSlab(slotSize) * (slotSize + sizeof(bufctl)) + sizeof(Slab);
-	return Allocator::bytes_required_to_blocks_allocated(bytes_required) * BLOCK_SIZE - bytes_required;
-}
-
-
-int Slab::blocksOccupied(size_t slotSize) {
-	int bytes_required = optimalNumOfSlotsPerSlab(slotSize) * (slotSize + sizeof(bufctl)) + sizeof(Slab);
-	return Allocator::bytes_required_to_blocks_allocated(bytes_required);
-}
-
-
-Slab::Slab(int _numOfSlots, size_t _slotSize, void* _space, void (*constructor)(void *), int offset) {
-	this->numOfSlots = _numOfSlots;
-	this->slotSize = _slotSize;
-	this->slotsOccupied = 0;
-	this->space = _space;
-	this->blocks = Allocator::bytes_required_to_blocks_allocated(_numOfSlots * (_slotSize + sizeof(bufctl)) + sizeof(Slab));
-	this->nextSlab = nullptr;
-	
-	bufctl* cur_bufctl = (bufctl*)((char*)space + sizeof(Slab));	// Slab object is stored at the beginning of its allocated memory.
-	/*
-	if ((char*)space + blocks * BLOCK_SIZE < (char*)cur_bufctl + numOfSlots * (sizeof(bufctl) + slotSize) + offset * CACHE_L1_LINE_SIZE / sizeof(char))
-		offset = 0;	// RESET OFFSET IN CASE OF INADEQUATE VALUE!
-	*/
-	this->object_space = (char*)cur_bufctl + numOfSlots * sizeof(bufctl) + offset * CACHE_L1_LINE_SIZE / sizeof(char);
-	this->freeSlot = cur_bufctl;
-
-	for (int i = 0; i < numOfSlots; i++) {
-		bufctl b;
-		b.next = (i == numOfSlots - 1) ? nullptr : cur_bufctl + 1;
-		b.initialized = true;
-		*cur_bufctl = b;
-		cur_bufctl++;
-		
-		if (constructor) (*constructor)(getObject(i));
-	}
-}
-
-
-bufctl* Slab::getBufctl(int index) {
-	if (index < 0 || index > numOfSlots) return nullptr;
-	bufctl* b = (bufctl*)((char*)space + sizeof(Slab));
-	return b + index;
-}
-
-
-int Slab::getIndex(bufctl* b) {
-	if (b == nullptr) return -1;	// error
-	bufctl* first_bufctl = (bufctl*)((char*)space + sizeof(Slab));
-	return b - first_bufctl;
-}
-
-
-void* Slab::getObject(int index) {
-	return (char*)object_space + index * slotSize;
-}
-
-
-void* Slab::alloc(void (*constructor)(void *)) {
-	if (freeSlot == nullptr) return nullptr;	// Error: no free slots.
-	int i = getIndex(freeSlot);
-	void* objp = getObject(i);
-	if (freeSlot->initialized == false) {	// Just in case?
-		if (constructor) (*constructor)(objp);
-		freeSlot->initialized = true;
-	}
-	// No need to change freeSlot->next.
-	freeSlot = freeSlot->next;	
-	slotsOccupied++;
-	return objp;
-}
-
-
-bool Slab::objectBelongsToSlab(void* objp) {
-	if (((char*)objp >= object_space) && ((char*)objp < (char*)object_space + numOfSlots * slotSize)) return true;
-	else return false;
-}
-
-
-bool Slab::free(void* objp) {
-	if (!objectBelongsToSlab(objp)) return false;
-	int index = ((char*)objp - (char*)object_space) / slotSize;
-	bufctl* b = getBufctl(index);
-	if (b == nullptr || b->initialized == false) return false;	// This means that no object has ever been allocated nor initialized in this slot.
-	// OBJECTS ARE NOT DESTROYED IN ORDER TO AVOID CONSTRUCTION IF SAME SLOT IS ALLOCATED NEXT TIME.
-	b->next = freeSlot;
-	freeSlot = b;
-	slotsOccupied--;
-	return true;
-}
-
-
-void Slab::destroyObjects(void(*destructor)(void *)) {
-	if (destructor)
-		for (int i = 0; i < numOfSlots; i++)
-			if (getBufctl(i)->initialized == true) (*destructor)(getObject(i));
+#include "slab class.h"
+#include "allocator.h"
+#include "slab.h"
+#include "cache.h"
+#include "memory ops.h"
+#include <new>
+#include <thread>
+
+
+Slab* Slab::createSlab(Cache* owner, int numOfSlots, size_t slotSize, size_t alignment, void (*constructor)(void *), Cache* metaCache, bool zero, bool deferConstruction, int* hugePage) {
+	bool offSlab = metaCache != nullptr;
+	void* descriptor = nullptr;
+	if (offSlab) {
+		descriptor = metaCache->alloc();
+		if (descriptor == nullptr) return nullptr;	// error
+	}
+	int blocks = blocksRequired(numOfSlots, slotSize, alignment, offSlab);
+	bool untouched = false;
+	void* space = Allocator::buddy_alloc_exact(blocks, &untouched, hugePage);
+	if (space == nullptr) {	// error
+		if (offSlab) metaCache->free(descriptor);
+		return nullptr;
+	}
+	if (zero && !untouched) {	// Everything after the header at once (with streaming stores if the slab is large).
+		size_t header = headerSize(numOfSlots, alignment, offSlab);
+		zero_memory((char*)space + header, (size_t)blocks * BLOCK_SIZE - header);
+	}
+	if (!offSlab) descriptor = space;	// Slab object is stored at the beginning of its allocated memory.
+	int colorOffset = owner->nextColor(space);	// (depends on where the blocks are)
+	size_t unused = (size_t)blocks * BLOCK_SIZE - spaceRequired(numOfSlots, slotSize, alignment, offSlab);
+	if ((size_t)colorOffset > unused) colorOffset = 0;	// Colors are counted for slabs of the optimal size (see Cache::slotsForLevel).
+	Slab* s = new (descriptor) Slab(owner, numOfSlots, slotSize, alignment, space, constructor, colorOffset, offSlab, zero, deferConstruction);	// Placement new!
+	Allocator::set_slab(space, s->getNumOfBlocks(), s);
+	return s;
+}
+
+
+size_t Slab::descriptorSize(int numOfSlots) {
+	return sizeof(Slab) + numOfSlots * sizeof(bufctl);
+}
+
+
+size_t Slab::headerSize(int numOfSlots, size_t alignment, bool offSlab) {
+	if (offSlab) return 0;
+	// Slabs begin at block boundaries, so rounding the header up aligns the objects.
+	if (alignment < SLAB_OBJECT_ALIGNMENT) alignment = SLAB_OBJECT_ALIGNMENT;
+	size_t bytes = descriptorSize(numOfSlots);
+	return (bytes + alignment - 1) / alignment * alignment;
+}
+
+
+size_t Slab::spaceRequired(int numOfSlots, size_t slotSize, size_t alignment, bool offSlab) {
+	return headerSize(numOfSlots, alignment, offSlab) + numOfSlots * slotSize;
+}
+
+
+int Slab::slotsThatFit(int bytes, size_t slotSize, size_t alignment, bool offSlab) {
+	if (offSlab) return bytes / slotSize;
+	if (bytes < (int)headerSize(0, alignment)) return 0;
+	int slots = (bytes - sizeof(Slab)) / (slotSize + sizeof(bufctl));
+	while (slots > 0 && spaceRequired(slots, slotSize, alignment) > (size_t)bytes) slots--;	// header rounding may cost a few slots
+	return slots;
+}
+
+
+int Slab::blocksRequired(int numOfSlots, size_t slotSize, size_t alignment, bool offSlab) {
+	return (int)((spaceRequired(numOfSlots, slotSize, alignment, offSlab) + BLOCK_SIZE - 1) / BLOCK_SIZE);
+}
+
+
+int Slab::optimalNumOfSlotsPerSlab(size_t slotSize, size_t alignment, bool offSlab, bool powerOfTwoBlocks) {
+	int optimal_num_of_slots = 0;
+	float max_ratio = 0;
+	if (!powerOfTwoBlocks) {	// Every number of blocks, from the smallest one that holds an object.
+		int min_blocks = blocksRequired(1, slotSize, alignment, offSlab);
+		if (min_blocks >= (1 << (N - 2))) return 0;	// error (byte counts do not fit into an int)
+		int max_blocks = min_blocks > MAX_SLAB_BLOCKS ? min_blocks : MAX_SLAB_BLOCKS;
+		for (int blocks = min_blocks; blocks <= max_blocks; blocks++) {
+			int bytes_available = blocks * BLOCK_SIZE;
+			int slots = slotsThatFit(bytes_available, slotSize, alignment, offSlab);
+			int bytes_remaining = bytes_available - spaceRequired(slots, slotSize, alignment, offSlab);
+			float ratio = (float)bytes_available / bytes_remaining;
+			if (ratio >= 32.) return slots;	// any size can be chosen, so the smallest slab that wastes 1/32 or less is accepted
+			if (ratio > max_ratio) {
+				max_ratio = ratio;
+				optimal_num_of_slots = slots;
+			}
+		}
+		return optimal_num_of_slots;
+	}
+	for (int i = 0, blocks = 1; i < N - 1; i++) {	// (byte counts of the largest chunk do not fit into an int)
+		int bytes_available = blocks * BLOCK_SIZE;
+		int slots = slotsThatFit(bytes_available, slotSize, alignment, offSlab);
+		int bytes_remaining = bytes_available - spaceRequired(slots, slotSize, alignment, offSlab);
+		float ratio = (float)bytes_available / bytes_remaining;
+		if (slots > 0 && ratio >= 8.) return slots;	// if 1/8 or less of available space is wasted, it is immediately accepted
+		if (slots > 0 && ratio > max_ratio) {
+			max_ratio = ratio;
+			optimal_num_of_slots = slots;
+		}
+		if (i >= MAX_N_OPTIMAL && slots > 0) return optimal_num_of_slots;	// prevents too large numbers of blocks from being taken
+		blocks *= 2;
+	}
+	return optimal_num_of_slots;
+}
+
+
+int Slab::minimalNumOfSlotsPerSlab(size_t slotSize, size_t alignment) {
+	for (int i = 0, blocks = 1; i < N - 1; i++) {
+		int slots = slotsThatFit(blocks * BLOCK_SIZE, slotSize, alignment);
+		if (slots > 0) return slots;
+		blocks *= 2;
+	}
+	return -1;	// error
+}
+
+
+int Slab::unusedSpaceWithOptimalSlots(size_t slotSize, size_t alignment, bool offSlab) {
+	int slots = optimalNumOfSlotsPerSlab(slotSize, alignment, offSlab);
+	return blocksRequired(slots, slotSize, alignment, offSlab) * BLOCK_SIZE - spaceRequired(slots, slotSize, alignment, offSlab);
+}
+
+
+int Slab::blocksOccupied(size_t slotSize, size_t alignment, bool offSlab) {
+	return blocksRequired(optimalNumOfSlotsPerSlab(slotSize, alignment, offSlab), slotSize, alignment, offSlab);
+}
+
+
+Slab::Slab(Cache* _owner, int _numOfSlots, size_t _slotSize, size_t alignment, void* _space, void (*constructor)(void *), int colorOffset, bool _offSlab, bool zeroed, bool deferConstruction) {
+	this->owner = _owner;
+	this->numOfSlots = _numOfSlots;
+	this->slotSize = _slotSize;
+	this->slotsOccupied = 0;
+	this->space = _space;
+	this->offSlab = _offSlab;
+	this->blocks = blocksRequired(_numOfSlots, _slotSize, alignment, _offSlab);
+	this->nextSlab = nullptr;
+	this->prevSlab = nullptr;
+	this->constructing.store(false, std::memory_order_relaxed);
+	
+	bufctl* cur_bufctl = (bufctl*)(this + 1);	// bufctl array follows the Slab object, on or off the slab.
+	/*
+	if ((char*)space + blocks * BLOCK_SIZE < (char*)cur_bufctl + numOfSlots * (sizeof(bufctl) + slotSize) + offset * CACHE_L1_LINE_SIZE / sizeof(char))
+		offset = 0;	// RESET OFFSET IN CASE OF INADEQUATE VALUE!
+	*/
+	this->object_space = (char*)space + headerSize(numOfSlots, alignment, offSlab) + colorOffset;
+	this->freeSlot = nullptr;
+	this->nextUnused = 0;	// No list to build: slots are handed out in address order.
+
+	bool build = constructor != nullptr && !deferConstruction;
+	for (int i = 0; i < numOfSlots; i++) {
+		bufctl* b = new (cur_bufctl) bufctl;	// Placement new! (the state is atomic)
+		b->next = nullptr;
+		b->state.store(build || constructor == nullptr ? SLOT_BUILT : SLOT_UNBUILT, std::memory_order_relaxed);
+		b->zeroed = zeroed && constructor == nullptr;
+		b->inUse = false;
+		cur_bufctl++;
+		
+		if (build) (*constructor)(getObject(i));
+	}
+}
+
+
+bufctl* Slab::getBufctl(int index) {
+	if (index < 0 || index > numOfSlots) return nullptr;
+	bufctl* b = (bufctl*)(this + 1);
+	return b + index;
+}
+
+
+int Slab::getIndex(bufctl* b) {
+	if (b == nullptr) return -1;	// error
+	bufctl* first_bufctl = (bufctl*)(this + 1);
+	return b - first_bufctl;
+}
+
+
+void* Slab::getObject(int index) {
+	return (char*)object_space + index * slotSize;
+}
+
+
+void* Slab::alloc(void (*constructor)(void *), bool zero) {
+	bufctl* b;
+	int i;
+	if (nextUnused < numOfSlots) {	// Adjacent slots for consecutive allocations.
+		i = nextUnused++;
+		b = getBufctl(i);
+		if (nextUnused < numOfSlots) prefetch_for_write(getObject(nextUnused));	// (its bufctl shares the line with b)
+	}
+	else if (freeSlot != nullptr) {
+		b = freeSlot;
+		i = getIndex(b);
+		// No need to change b->next.
+		freeSlot = b->next;
+		if (freeSlot != nullptr) {	// The object address needs only the index, not the bufctl itself.
+			prefetch_for_write(freeSlot);
+			prefetch_for_write(getObject(getIndex(freeSlot)));
+		}
+	}
+	else return nullptr;	// Error: no free slots.
+	void* objp = getObject(i);
+	if (b->state.load(std::memory_order_acquire) != SLOT_BUILT) claimSlot(b, objp, constructor);	// (deferred construction)
+	if (zero && !b->zeroed) zero_memory(objp, slotSize);
+	b->zeroed = false;
+	b->inUse = true;
+	slotsOccupied++;
+	return objp;
+}
+
+
+bool Slab::objectBelongsToSlab(void* objp) {
+	if (((char*)objp >= object_space) && ((char*)objp < (char*)object_space + numOfSlots * slotSize)) return true;
+	else return false;
+}
+
+
+size_t Slab::usableSize(const void* objp) {
+	if (!objectBelongsToSlab((void*)objp)) return 0;
+	return slotSize - ((const char*)objp - (char*)object_space) % slotSize;
+}
+
+
+bool Slab::free(void* objp) {
+	if (!objectBelongsToSlab(objp)) return false;
+	int index = ((char*)objp - (char*)object_space) / slotSize;
+	bufctl* b = getBufctl(index);
+	if (b == nullptr || b->state.load(std::memory_order_relaxed) != SLOT_BUILT) return false;	// This means that no object has ever been allocated nor initialized in this slot.
+	if (!b->inUse) return false;	// Double free: the slot is already free (counted and listed once).
+	// OBJECTS ARE NOT DESTROYED IN ORDER TO AVOID CONSTRUCTION IF SAME SLOT IS ALLOCATED NEXT TIME.
+	b->inUse = false;
+	slotsOccupied--;
+	if (slotsOccupied == 0) {	// Start over in address order (the list is dropped, not walked).
+		freeSlot = nullptr;
+		nextUnused = 0;
+	}
+	else if (index == nextUnused - 1) nextUnused--;	// The last slot handed out in order goes back to the ordered part.
+	else {
+		b->next = freeSlot;
+		freeSlot = b;
+	}
+	return true;
+}
+
+
+void* Slab::usedSlot(int index) {
+	if (index < 0 || index >= numOfSlots || !getBufctl(index)->inUse) return nullptr;
+	return getObject(index);
+}
+
+
+void Slab::destroyObjects(void(*destructor)(void *)) {
+	if (destructor)
+		for (int i = 0; i < numOfSlots; i++)
+			if (getBufctl(i)->state.load(std::memory_order_relaxed) == SLOT_BUILT) (*destructor)(getObject(i));
+}
+
+
+void Slab::claimSlot(bufctl* b, void* objp, void (*constructor)(void *)) {
+	unsigned char expected = SLOT_UNBUILT;
+	if (b->state.compare_exchange_strong(expected, SLOT_BUILDING, std::memory_order_acquire)) {
+		if (constructor) (*constructor)(objp);
+		b->state.store(SLOT_BUILT, std::memory_order_release);
+		return;
+	}
+	while (b->state.load(std::memory_order_acquire) != SLOT_BUILT) std::this_thread::yield();	// A helper is building it.
+}
+
+
+void Slab::constructSlots(void (*constructor)(void *)) {
+	for (int i = 0; i < numOfSlots; i++) {	// In the order slots are handed out, so allocations find them built.
+		bufctl* b = getBufctl(i);
+		unsigned char expected = SLOT_UNBUILT;
+		if (b->state.compare_exchange_strong(expected, SLOT_BUILDING, std::memory_order_acquire)) {
+			(*constructor)(getObject(i));
+			b->state.store(SLOT_BUILT, std::memory_order_release);
+		}
+	}
+	constructing.store(false, std::memory_order_release);
+}
+
+
+void Slab::waitForConstruction() {
+	while (constructing.load(std::memory_order_acquire)) std::this_thread::yield();
 }
\ No newline at end of file
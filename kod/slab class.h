@@ -1,90 +1,145 @@
-#pragma once
-
-#include "allocator.h"
-#include "slab.h"
-
-#define MAX_N_OPTIMAL (6)
-
-
-struct bufctl {
-	bufctl* next;
- 	bool initialized;
-	// Add const int index and remove Slab::getIndex(bufctl*)?
-};
-
-
-class Slab {
-private:
-	void* space;
-	void* object_space;
-	int numOfSlots;
-	int slotsOccupied;
-	size_t slotSize;
-	int blocks;
-
-	bufctl* freeSlot;
-
-	Slab* nextSlab;
-
-	Slab(int _numOfSlots, size_t _slotSize, void* _space, void(*constructor)(void *), int offset);	// objects are created from outside with static createSlab(...) method
-
-	bufctl* getBufctl(int index);
-	int getIndex(bufctl* b);
-
-	void* getObject(int index);
-public:
-	static Slab* createSlab(int numOfSlots, size_t slotSize, void (*constructor)(void *), int offset);
-
-	inline void* getSpace() const {
-		return space;
-	}
-
-	inline size_t getTotalSize() const {
-		return blocks * BLOCK_SIZE;
-	}
-
-	inline int getNumOfBlocks() const {
-		return blocks;
-	}
-
-	inline int getNumOfSlots() const {
-		return numOfSlots;
-	}
-
-	inline int getSlotsOccupied() const {
-		return slotsOccupied;
-	}
-
-	inline size_t getSlotSize() const {
-		return slotSize;
-	}
-
-	inline Slab* getNext() const {
-		return nextSlab;
-	}
-
-	inline void setNext(Slab* s) {
-		nextSlab = s;
-	}
-
-	inline bool isFull() const {
-		return numOfSlots == slotsOccupied;
-	}
-
-	inline bool isEmpty() const {
-		return slotsOccupied == 0;
-	}
-
-	void* alloc(void (*constructor)(void *));
-
-	bool objectBelongsToSlab(void* objp);
-
-	bool free(void* objp);
-
-	void destroyObjects(void (*destructor)(void *));
-
-	static int optimalNumOfSlotsPerSlab(size_t slotSize);
-	static int minimalNumOfSlotsPerSlab(size_t slotSize);
-	static int unusedSpaceWithOptimalSlots(size_t slotSize);
-	static int blocksOccupied(size_t slotSize);
+#pragma once
+
+#include <atomic>
+#include "allocator.h"
+#include "slab.h"
+
+#define MAX_N_OPTIMAL (6)
+#define MAX_SLAB_BLOCKS (1 << MAX_N_OPTIMAL)	// slabs are not made larger than this unless a single object needs it
+#define SLAB_OBJECT_ALIGNMENT (16)	// objects of every slab start at a multiple of this (relative to the aligned arena)
+
+#define SLOT_UNBUILT (0)	// bufctl::state: the constructor has not run yet
+#define SLOT_BUILDING (1)	// an allocation or a construction helper is running it
+#define SLOT_BUILT (2)
+
+
+struct bufctl {
+	bufctl* next;
+	std::atomic<unsigned char> state;	// SLOT_*; slots of slabs built by helper threads are claimed with a CAS
+	bool zeroed;	// the object has been zeroed with its slab and not handed out since
+	bool inUse;	// the object is allocated (see Cache::compact)
+	// Add const int index and remove Slab::getIndex(bufctl*)?
+};
+
+
+class Cache;
+
+
+class Slab {
+private:
+	Cache* owner;
+	void* space;
+	void* object_space;
+	int numOfSlots;
+	int slotsOccupied;
+	size_t slotSize;
+	int blocks;
+	bool offSlab;	// the Slab object and bufctl array are not in the slab's blocks (see Cache::metaCache)
+
+	bufctl* freeSlot;	// slots freed since the slab was last empty, most recent first
+	int nextUnused;	// slots from here on are free and handed out in order, before freeSlot is used
+
+	Slab* nextSlab;
+	Slab* prevSlab;
+
+	std::atomic<bool> constructing;	// queued for or being built by a construction helper (see ConstructionPool)
+
+	Slab(Cache* _owner, int _numOfSlots, size_t _slotSize, size_t alignment, void* _space, void(*constructor)(void *), int colorOffset, bool _offSlab, bool zeroed, bool deferConstruction);	// objects are created from outside with static createSlab(...) method
+
+	bufctl* getBufctl(int index);
+	int getIndex(bufctl* b);
+
+	void* getObject(int index);
+	void claimSlot(bufctl* b, void* objp, void (*constructor)(void *));	// builds the object unless a helper does, then waits for it
+public:
+	static Slab* createSlab(Cache* owner, int numOfSlots, size_t slotSize, size_t alignment, void (*constructor)(void *), Cache* metaCache = nullptr, bool zero = false, bool deferConstruction = false, int* hugePage = nullptr);	// the color comes from owner; the descriptor is taken from metaCache if there is one; hugePage: see Allocator::buddy_alloc_exact
+																																											// zero: objects are zeroed before construction, all at once
+																																											// deferConstruction: objects are built later (helpers or allocations)
+
+	inline Cache* getOwner() const {
+		return owner;
+	}
+
+	inline void* getSpace() const {
+		return space;
+	}
+
+	inline size_t getTotalSize() const {
+		return blocks * BLOCK_SIZE;
+	}
+
+	inline int getNumOfBlocks() const {
+		return blocks;
+	}
+
+	inline bool isOffSlab() const {
+		return offSlab;
+	}
+
+	inline int getNumOfSlots() const {
+		return numOfSlots;
+	}
+
+	inline int getSlotsOccupied() const {
+		return slotsOccupied;
+	}
+
+	inline size_t getSlotSize() const {
+		return slotSize;
+	}
+
+	inline Slab* getNext() const {
+		return nextSlab;
+	}
+
+	inline void setNext(Slab* s) {
+		nextSlab = s;
+	}
+
+	inline Slab* getPrev() const {
+		return prevSlab;
+	}
+
+	inline void setPrev(Slab* s) {
+		prevSlab = s;
+	}
+
+	inline bool isFull() const {
+		return numOfSlots == slotsOccupied;
+	}
+
+	inline bool isEmpty() const {
+		return slotsOccupied == 0;
+	}
+
+	void* alloc(void (*constructor)(void *), bool zero = false);	// zero: the object is returned zeroed; the next free slot is prefetched
+
+	bool objectBelongsToSlab(void* objp);
+
+	size_t usableSize(const void* objp);	// bytes from objp to the end of its slot
+
+	bool free(void* objp);
+
+	void* usedSlot(int index);	// the object in the slot, nullptr if the slot is free
+
+	void destroyObjects(void (*destructor)(void *));
+
+	inline void beginConstruction() {	// before the slab is queued for a helper
+		constructing.store(true, std::memory_order_relaxed);
+	}
+	void constructSlots(void (*constructor)(void *));	// by a helper, without the owner's lock: builds the slots nobody has claimed yet
+	void waitForConstruction();	// before the slab is destroyed
+
+	// Geometry: objects start at a multiple of the alignment (at least SLAB_OBJECT_ALIGNMENT), slotSize is their stride.
+	// Off-slab slabs have no header, their objects start at the first block.
+	static size_t descriptorSize(int numOfSlots);	// Slab object followed by its bufctl array
+	static size_t headerSize(int numOfSlots, size_t alignment = 1, bool offSlab = false);	// descriptor rounded up to the object alignment, 0 if off-slab
+	static size_t spaceRequired(int numOfSlots, size_t slotSize, size_t alignment = 1, bool offSlab = false);
+	static int slotsThatFit(int bytes, size_t slotSize, size_t alignment = 1, bool offSlab = false);
+	static int blocksRequired(int numOfSlots, size_t slotSize, size_t alignment = 1, bool offSlab = false);	// slabs take exactly as many blocks as they need
+
+	static int optimalNumOfSlotsPerSlab(size_t slotSize, size_t alignment = 1, bool offSlab = false, bool powerOfTwoBlocks = false);	// powerOfTwoBlocks: old geometry, for comparison
+	static int minimalNumOfSlotsPerSlab(size_t slotSize, size_t alignment = 1);
+	static int unusedSpaceWithOptimalSlots(size_t slotSize, size_t alignment = 1, bool offSlab = false);
+	static int blocksOccupied(size_t slotSize, size_t alignment = 1, bool offSlab = false);
 };
\ No newline at end of file
@@ -1,56 +1,140 @@
-#include "slab.h"
-#include "allocator.h"
-#include "cache.h"
-
-
-
-void kmem_init(void *space, int block_num) {
-	Allocator::init(space, block_num);
-}
-
-kmem_cache_t *kmem_cache_create(const char *name, size_t size, void(*ctor)(void *), void(*dtor)(void *)) {
-	return Allocator::cache_create(name, size, ctor, dtor);
-}
-
-int kmem_cache_shrink(kmem_cache_t *cachep) {
-	return cachep->shrink();
-}
-
-void *kmem_cache_alloc(kmem_cache_t *cachep) {
-	return cachep->alloc();
-}
-
-void kmem_cache_free(kmem_cache_t * cachep, void * objp) {
-	cachep->free(objp);
-}
-
-void *kmalloc(size_t size) {
-	return Allocator::malloc(size);
-}
-
-void kfree(const void *objp) {
-	Allocator::free(objp);
-}
-
-void kmem_cache_destroy(kmem_cache_t *cachep) {
-	Allocator::cache_destroy(cachep);
-}
-
-void kmem_cache_info(kmem_cache_t *cachep) {
-	cachep->info();
-}
-
-void kmem_sizes_info(int i) {
-	Allocator::sizes_info(i);
-}
-
-int kmem_cache_error(kmem_cache_t *cachep) {
-	return cachep->error();
-}
-
-
-
-
-
-
-
+#include "slab.h"
+#include "allocator.h"
+#include "cache.h"
+#include "epoch.h"
+#include "metrics.h"
+
+
+
+void kmem_init(void *space, int block_num) {
+	Allocator::init(space, block_num);
+}
+
+int kmem_init_arena(size_t size, unsigned int flags) {
+	return Allocator::init_arena(size, flags);
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, void(*ctor)(void *), void(*dtor)(void *)) {
+	return Allocator::cache_create(name, size, ctor, dtor);
+}
+
+kmem_cache_t *kmem_cache_create_aligned(const char *name, size_t size, size_t align, unsigned int flags, void(*ctor)(void *), void(*dtor)(void *)) {
+	if (align == 0) align = 1;
+	if ((flags & SLAB_HWCACHE_ALIGN) && align < Allocator::line_size()) align = Allocator::line_size();
+	return Allocator::cache_create(name, size, ctor, dtor, align, flags);
+}
+
+kmem_cache_t *kmem_cache_create_movable(const char *name, size_t size, void(*ctor)(void *), void(*dtor)(void *), int(*relocate)(void *, void *)) {
+	return Allocator::cache_create_movable(name, size, ctor, dtor, relocate);
+}
+
+void kmem_cache_merging(int enabled) {
+	Allocator::set_cache_merging(enabled != 0);
+}
+
+int kmem_cache_shrink(kmem_cache_t *cachep) {
+	return cachep->shrink();
+}
+
+int kmem_cache_compact(kmem_cache_t *cachep) {
+	return cachep->compact();
+}
+
+int kmem_cache_prefill(kmem_cache_t *cachep, int count) {
+	return cachep->prefill(count);
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cachep) {
+	return cachep->alloc();
+}
+
+void *kmem_cache_zalloc(kmem_cache_t *cachep) {
+	return cachep->alloc(true, true);
+}
+
+void kmem_cache_free(kmem_cache_t * cachep, void * objp) {
+	cachep->free(objp);
+}
+
+void kmem_cache_free_deferred(kmem_cache_t *cachep, void *objp) {
+	Epoch::retire(cachep, objp);
+}
+
+void kmem_epoch_enter(void) {
+	Epoch::enter();
+}
+
+void kmem_epoch_exit(void) {
+	Epoch::exit();
+}
+
+int kmem_epoch_synchronize(void) {
+	return Epoch::synchronize();
+}
+
+void *kmalloc(size_t size) {
+	return Allocator::malloc(size);
+}
+
+void *kmalloc_hint(size_t size, unsigned int flags) {
+	return Allocator::malloc_hint(size, flags);
+}
+
+void *kzalloc(size_t size) {
+	return Allocator::zmalloc(size);
+}
+
+void *krealloc(const void *objp, size_t new_size) {
+	return Allocator::realloc((void*)objp, new_size);
+}
+
+void kfree(const void *objp) {
+	Allocator::free(objp);
+}
+
+void kfree_sized(const void *objp, size_t size) {
+	Allocator::free_sized(objp, size);
+}
+
+void kmem_cache_destroy(kmem_cache_t *cachep) {
+	Allocator::cache_destroy(cachep);
+}
+
+void kmem_cache_info(kmem_cache_t *cachep) {
+	cachep->info();
+}
+
+kmem_cache_t *kmem_cache_find(const char *name) {
+	return Allocator::cache_find(name);
+}
+
+void kmem_caches_info(void) {
+	Allocator::for_each_cache([](Cache* c, void*) { c->info(); }, nullptr);
+}
+
+void kmem_sizes_info(int i) {
+	Allocator::sizes_info(i);
+}
+
+int kmem_cache_error(kmem_cache_t *cachep) {
+	return cachep->error();
+}
+
+int kmem_metrics_write(const char *path) {
+	return Metrics::write(path);
+}
+
+int kmem_metrics_start(const char *path, int interval_ms) {
+	return Metrics::start(path, interval_ms);
+}
+
+void kmem_metrics_stop(void) {
+	Metrics::stop();
+}
+
+
+
+
+
+
+
@@ -8,18 +8,58 @@ typedef struct kmem_cache_s kmem_cache_t;
 #define BLOCK_SIZE (4096)
 #define CACHE_L1_LINE_SIZE (64)
 
+#define SLAB_HWCACHE_ALIGN (0x1) // Align objects to cache lines, so that no two objects share one
+#define SLAB_NO_MERGE (0x2) // Never share slabs with other caches (see kmem_cache_merging)
+#define SLAB_COLOR_PER_THREAD (0x4) // Slabs created by different threads start at different colors
+#define SLAB_NO_COLOR (0x8) // All slabs place their objects at the same offsets
+#define SLAB_ASYNC_CTOR (0x10) // Helper threads run the constructor for new slabs; a spare slab is kept built ahead of allocations
+
+#define KMALLOC_SHORT_LIVED (0x1) // kmalloc_hint: freed soon, so its slabs become free as a whole and are reclaimed
+#define KMALLOC_LONG_LIVED (0x2) // kmalloc_hint: outlives most buffers, kept away from slabs that churn
+#define KMALLOC_PERMANENT (0x3) // kmalloc_hint: (almost) never freed, its slabs are never shrunk
+#define KMALLOC_LIFETIME_MASK (0x3)
+
+#define KMEM_ARENA_HUGETLB (0x1) // kmem_init_arena: reserved huge pages (MAP_HUGETLB), transparent ones if there are none
+#define KMEM_ARENA_THP (0x2) // kmem_init_arena: transparent huge pages (madvise MADV_HUGEPAGE)
+
 
 void kmem_init(void *space, int block_num);
+int kmem_init_arena(size_t size, unsigned int flags); // Map the space; with huge pages, slabs of one cache are packed into its own 2 MB pages. Returns the KMEM_ARENA_* pages obtained (0: small pages), -1 if mapping fails
 
 kmem_cache_t *kmem_cache_create(const char *name, size_t size,
                                 void (*ctor)(void *),
                                 void (*dtor)(void *)); // Allocate cache
+kmem_cache_t *kmem_cache_create_aligned(const char *name, size_t size,
+                                        size_t align, unsigned int flags,
+                                        void (*ctor)(void *),
+                                        void (*dtor)(void *)); // Allocate cache of aligned objects
+kmem_cache_t *kmem_cache_create_movable(const char *name, size_t size,
+                                        void (*ctor)(void *),
+                                        void (*dtor)(void *),
+                                        int (*relocate)(void *from, void *to)); // Allocate cache whose objects kmem_cache_compact may move (relocate moves one object, 0 keeps it)
+void kmem_cache_merging(int enabled); // New caches without ctor/dtor may share slabs of a compatible cache
 int kmem_cache_shrink(kmem_cache_t *cachep); // Shrink cache
+int kmem_cache_compact(kmem_cache_t *cachep); // Move objects out of sparse slabs and free them, returns blocks freed (-1 if not movable)
+int kmem_cache_prefill(kmem_cache_t *cachep, int count); // Create free slabs for count objects before they are needed (built by helpers with SLAB_ASYNC_CTOR), returns slabs created (-1 if out of memory)
 void *kmem_cache_alloc(kmem_cache_t *cachep); // Allocate one object from cache
+void *kmem_cache_zalloc(kmem_cache_t *cachep); // Allocate one zeroed object from cache
 void kmem_cache_free(kmem_cache_t *cachep, void *objp); // Deallocate one object from cache
+void kmem_cache_free_deferred(kmem_cache_t *cachep, void *objp); // Deallocate one object once no reader can see it any more
+void kmem_epoch_enter(void); // Begin a reader critical section (objects freed with kmem_cache_free_deferred stay valid)
+void kmem_epoch_exit(void); // End a reader critical section
+int kmem_epoch_synchronize(void); // Wait until objects deferred by this thread are freed (e.g. before destroying the cache)
 void *kmalloc(size_t size); // Alloacate one small memory buffer
+void *kmalloc_hint(size_t size, unsigned int flags); // Allocate one small memory buffer next to buffers of the same expected lifetime
+void *kzalloc(size_t size); // Allocate one zeroed small memory buffer
+void *krealloc(const void *objp, size_t new_size); // Resize a buffer: in place within its size class or its block run, otherwise moved (NULL if that fails, objp stays valid)
 void kfree(const void *objp); // Deallocate one small memory buffer
+void kfree_sized(const void *objp, size_t size); // Deallocate one small memory buffer of known size
 void kmem_cache_destroy(kmem_cache_t *cachep); // Deallocate cache
 void kmem_cache_info(kmem_cache_t *cachep); // Print cache info
+kmem_cache_t *kmem_cache_find(const char *name); // Find cache by name, NULL if there is none (safe while caches are created or destroyed)
+void kmem_caches_info(void); // Print info of all caches
 void kmem_sizes_info(int i);
 int kmem_cache_error(kmem_cache_t *cachep); // Print error message
+int kmem_metrics_write(const char *path); // Write counters and gauges of all caches and the buddy allocator in the Prometheus text format (through path.tmp, renamed), -1 on error
+int kmem_metrics_start(const char *path, int interval_ms); // Write them every interval_ms from a helper thread; "unix:<path>" serves one export to each client of a Unix-domain socket instead
+void kmem_metrics_stop(void); // Stop the helper thread (within one interval)
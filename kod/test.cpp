@@ -1,21 +1,256 @@
-#include <vector>
-#include <thread>
-#include <cstdio>
-
-#include "slab.h"
-#include "test.h"
-
-//extern "C" {
-	void run_threads(int (*work)(struct data_s), void *data, int num) {
-		std::vector<std::thread> threads;
-		for (int i = 0; i < num; i++) {
-			struct data_s private_data = *(struct data_s*) data;
-			private_data.id = i + 1;
-			threads.emplace_back(work, private_data);
-		}
-
-		for (int i = 0; i < num; i++) {
-			threads[i].join();
-		}
-	}
-//}
\ No newline at end of file
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include "slab.h"
+#include "allocator.h"
+#include "mempool class.h"
+#include "test.h"
+
+//extern "C" {
+	void run_threads(int (*work)(struct data_s), void *data, int num) {
+		std::vector<std::thread> threads;
+		for (int i = 0; i < num; i++) {
+			struct data_s private_data = *(struct data_s*) data;
+			private_data.id = i + 1;
+			threads.emplace_back(work, private_data);
+		}
+
+		for (int i = 0; i < num; i++) {
+			threads[i].join();
+		}
+	}
+//}
+
+// Runs parked in the page cache of a thread go back to the buddy lists when the thread ends.
+int test_page_cache_exit() {
+	int chunks[N];
+	Allocator::drain_page_cache();
+	int before = Allocator::buddy_free_chunks(chunks);
+	std::thread worker([]() {
+		kmem_cache_t* cache = kmem_cache_create("page cache exit", 2000, nullptr, nullptr);
+		std::vector<void*> objs;
+		for (int i = 0; i < 64; i++) objs.push_back(kmem_cache_alloc(cache));
+		for (void* p : objs) kmem_cache_free(cache, p);
+		kmem_cache_shrink(cache);	// its slabs are kept by this thread
+		kmem_cache_destroy(cache);
+	});
+	worker.join();
+	int after = Allocator::buddy_free_chunks(chunks);
+	printf_s("test page cache exit: free blocks %d before the thread, %d after: %s\n", before, after, after == before ? "ok" : "FAILED");
+	return after == before ? 0 : 1;
+}
+
+
+// A mempool gives out its reserve when the cache cannot grow, returns NULL without waiting once the
+// reserve is gone too (MEMPOOL_NOWAIT) and fills the reserve again when memory comes back.
+int test_mempool() {
+	const int min_nr = 8;
+	kmem_cache_t* cache = kmem_cache_create("mempool test", 256, nullptr, nullptr);
+	mempool_t* pool = mempool_create(min_nr, cache);
+	if (pool == nullptr) {
+		printf_s("test mempool: no memory for the pool: FAILED\n");
+		kmem_cache_destroy(cache);
+		return 1;
+	}
+	std::vector<void*> hogs;	// all the memory left, so the cache cannot grow
+	for (size_t size = (size_t)BLOCK_SIZE << 8; size >= 32; size /= 2)
+		for (void* p; (p = kmalloc(size)) != nullptr;) hogs.push_back(p);
+
+	std::vector<void*> objs;
+	for (void* p; (p = mempool_alloc(pool, MEMPOOL_NOWAIT)) != nullptr;) objs.push_back(p);
+	bool drained = ((Mempool*)pool)->getReserved() == 0 && objs.size() >= min_nr;
+
+	std::thread freer([&]() {	// a waiting allocation gets the first object freed to the pool
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		mempool_free(pool, objs.back());
+	});
+	objs.back() = mempool_alloc(pool, MEMPOOL_WAIT);
+	freer.join();
+	bool waited = objs.back() != nullptr;
+
+	for (void* p : hogs) kfree(p);
+	bool refilled = false;
+	for (int i = 0; i < 1000 && !refilled; i++) {
+		refilled = ((Mempool*)pool)->getReserved() == min_nr;
+		if (!refilled) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	for (void* p : objs) mempool_free(pool, p);
+	mempool_destroy(pool);
+	kmem_cache_destroy(cache);
+	bool ok = drained && waited && refilled;
+	printf_s("test mempool: %d objects until NULL, reserve %s, waiting allocation %s, reserve %s: %s\n", (int)objs.size(),
+		drained ? "drained" : "NOT DRAINED", waited ? "served" : "NOT SERVED", refilled ? "refilled" : "NOT REFILLED", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+
+// Chunks kept unjoined by the lazy buddy system pass check_buddy() and are joined when an allocation
+// needs a chunk of the largest order: all of those are taken, one is freed block by block (the first
+// blocks stay lazy, so it does not join up again) and one more is asked for.
+int test_lazy_buddies() {
+	int chunks[N], lazy = 0;
+	Allocator::set_page_cache(false);
+	Allocator::set_lazy_chunks(BUDDY_LAZY_CHUNKS);	// (joins the chunks kept so far)
+	int before = Allocator::buddy_free_chunks(chunks);
+	int largest = N - 1;
+	while (largest > 0 && chunks[largest] == 0) largest--;
+
+	std::vector<void*> held;
+	for (void* p; (p = Allocator::buddy_alloc(largest)) != nullptr;) held.push_back(p);
+	int first = Allocator::block_index(held.back());
+	held.pop_back();
+	for (int n = first; n < first + (1 << largest); n++) Allocator::buddy_free(n, 0);
+	Allocator::buddy_free_chunks(chunks, &lazy);
+	bool lazyOk = lazy > 0 && chunks[largest] == 0 && Allocator::check_buddy() >= 0;
+
+	void* large = Allocator::buddy_alloc(largest);	// only there once the lazy chunks are joined
+	bool joinedOk = large != nullptr && Allocator::check_buddy() >= 0;
+	if (large != nullptr) held.push_back(large);
+	for (void* p : held) Allocator::buddy_free(Allocator::block_index(p), largest);
+	bool restored = Allocator::check_buddy() == before;
+	Allocator::set_page_cache(true);
+
+	bool ok = lazyOk && joinedOk && restored;
+	printf_s("test lazy buddies: 2^%d blocks freed one by one, %d chunks kept lazy, chunk of 2^%d blocks %s: %s\n", largest, lazy, largest,
+		large != nullptr ? "allocated" : "NOT ALLOCATED", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+
+// Freeing an object twice is reported and leaves the slab as it was: its slot is handed out once.
+int test_double_free() {
+	kmem_cache_t* cache = kmem_cache_create("double free", 64, nullptr, nullptr);
+	void* a = kmem_cache_alloc(cache);
+	void* b = kmem_cache_alloc(cache);
+	kmem_cache_free(cache, a);
+	kmem_cache_free(cache, a);
+	bool reported = kmem_cache_error(cache) != 0;
+	std::vector<void*> objs;
+	for (int i = 0; i < 256; i++) objs.push_back(kmem_cache_alloc(cache));
+	std::vector<void*> sorted(objs);
+	std::sort(sorted.begin(), sorted.end());
+	bool ok = reported && std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end() && cache->check() == 257;
+	kmem_cache_free(cache, b);
+	for (void* p : objs) kmem_cache_free(cache, p);
+	ok = ok && cache->check() == 0;
+	kmem_cache_destroy(cache);
+	printf_s("test double free: %s: %s\n", reported ? "reported" : "NOT REPORTED", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+
+// A mempool whose cache has free slots takes nothing from its reserve, however busy the cache is.
+int test_mempool_contended() {
+	const int min_nr = 8;
+	kmem_cache_t* cache = kmem_cache_create("mempool contended", 256, nullptr, nullptr);
+	mempool_t* pool = mempool_create(min_nr, cache);
+	if (pool == nullptr || kmem_cache_prefill(cache, 256) < 0) {
+		printf_s("test mempool contended: no memory: FAILED\n");
+		if (pool != nullptr) mempool_destroy(pool);
+		kmem_cache_destroy(cache);
+		return 1;
+	}
+	std::atomic<bool> stop(false);
+	std::thread hammer([&]() {
+		void* objs[16];
+		while (!stop.load()) {
+			for (void*& p : objs) p = kmem_cache_alloc(cache);
+			for (void* p : objs) kmem_cache_free(cache, p);
+		}
+	});
+	int fromReserve = 0, rounds = 0;
+	auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(200);	// many time slices, also on one core
+	for (; std::chrono::steady_clock::now() < end; rounds++) {
+		void* p = mempool_alloc(pool, MEMPOOL_NOWAIT);
+		if (p == nullptr || ((Mempool*)pool)->getReserved() < min_nr) fromReserve++;
+		mempool_free(pool, p);
+	}
+	stop.store(true);
+	hammer.join();
+	mempool_destroy(pool);
+	kmem_cache_destroy(cache);
+	printf_s("test mempool contended: %d of %d allocations went to the reserve: %s\n", fromReserve, rounds, fromReserve == 0 ? "ok" : "FAILED");
+	return fromReserve == 0 ? 0 : 1;
+}
+
+
+// Alignments above BLOCK_SIZE hold wherever the space begins; the trimmed runs go back to the buddy lists.
+int test_aligned_alloc() {
+	int chunks[N];
+	Allocator::drain_page_cache();
+	int before = Allocator::buddy_free_chunks(chunks);
+	int failed = 0;
+	for (size_t alignment = 2 * BLOCK_SIZE; alignment <= 16 * BLOCK_SIZE; alignment *= 2)
+		for (size_t size : { (size_t)1, (size_t)BLOCK_SIZE, 3 * alignment }) {
+			void* p = Allocator::malloc_aligned(size, alignment);
+			if (p == nullptr || ((uintptr_t)p & (alignment - 1)) != 0) failed++;
+			else {
+				memset(p, 0xA5, size);
+				Allocator::free(p);
+			}
+		}
+	Allocator::drain_page_cache();
+	bool ok = failed == 0 && Allocator::buddy_free_chunks(chunks) == before && Allocator::check_buddy() >= 0;
+	printf_s("test aligned alloc: %d misaligned or missing: %s\n", failed, ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+
+// Slab size tuning: a hot cache goes up a level every TUNE_WINDOW new slabs if its lock counts as
+// contended (always with -DTUNE_CONTENDED_PERCENT=0, otherwise up to the machine, so not checked);
+// two kmem_cache_shrink calls with no operation between them find it idle and drop it to level 0.
+int test_tuning() {
+	if (TUNE_WINDOW == 0) {
+		printf_s("test tuning: tuning is off: ok\n");
+		return 0;
+	}
+	kmem_cache_t* cache = kmem_cache_create("tuning test", 64, nullptr, nullptr);
+	std::vector<void*> objs;
+	for (int i = 0; i < 20000; i++) objs.push_back(kmem_cache_alloc(cache));
+	int hotLevel = cache->tuneLevel();
+	for (void* p : objs) kmem_cache_free(cache, p);
+	std::this_thread::sleep_for(std::chrono::milliseconds(TUNE_IDLE_MIN_MS + 1));
+	kmem_cache_shrink(cache);	// Counts the operations above, so the cache is not idle yet,
+	std::this_thread::sleep_for(std::chrono::milliseconds(TUNE_IDLE_MIN_MS + 1));
+	kmem_cache_shrink(cache);	// but it is now: no operation since the last check.
+	int idleLevel = cache->tuneLevel();
+	kmem_cache_destroy(cache);
+	bool rise = TUNE_CONTENDED_PERCENT == 0;
+	bool ok = (!rise || hotLevel == TUNE_MAX_LEVEL) && idleLevel == 0;
+	printf_s("test tuning: level %d while hot%s, %d when idle: %s\n", hotLevel, rise ? "" : " (not checked)", idleLevel, ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+
+// A cache merged under the name of the cache it joins is still reported as an alias, with its own counters.
+int test_merged_alias() {
+	kmem_cache_merging(1);
+	kmem_cache_t* first = kmem_cache_create("buf", 40, nullptr, nullptr);
+	kmem_cache_t* second = kmem_cache_create("buf", 40, nullptr, nullptr);
+	kmem_cache_merging(0);
+	void* obj = kmem_cache_alloc(second);
+	std::ostringstream out;
+	std::streambuf* old = std::cout.rdbuf(out.rdbuf());
+	kmem_cache_info(first);
+	std::string firstInfo = out.str();
+	out.str("");
+	kmem_cache_info(second);
+	std::string secondInfo = out.str();
+	std::cout.rdbuf(old);
+	kmem_cache_free(second, obj);
+	bool alias = secondInfo.find("buf (alias of buf)\n") != std::string::npos;	// (only merged handles are aliases)
+	bool ok = alias && firstInfo.find("alias of") == std::string::npos && secondInfo.find("1 obj in use\n1 allocs, 0 frees") != std::string::npos;
+	kmem_cache_destroy(second);
+	kmem_cache_destroy(first);
+	printf_s("test merged alias: second \"buf\" handle %s: %s\n", alias ? "reported as an alias" : "NOT REPORTED", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
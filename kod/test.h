@@ -7,4 +7,14 @@ struct data_s {
 	int id;
 	kmem_cache_t *shared;
 	int iterations;
-};
\ No newline at end of file
+};
+
+// Checks of the allocator; each prints one line and returns 0 if it holds.
+int test_page_cache_exit();
+int test_mempool();
+int test_mempool_contended();
+int test_lazy_buddies();
+int test_double_free();
+int test_aligned_alloc();
+int test_tuning();
+int test_merged_alias();
\ No newline at end of file